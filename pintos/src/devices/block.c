@@ -1,9 +1,35 @@
 #include "devices/block.h"
 #include <list.h>
+#include <round.h>
 #include <string.h>
 #include <stdio.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Maximum number of sectors in a run of merged requests. */
+#define MERGE_MAX 64
+
+/* Number of buckets in the request latency histogram.  Bucket 0
+   counts requests that completed within a microsecond, bucket
+   I > 0 those that took at least 4**(I - 1) but less than 4**I
+   microseconds, and the last bucket everything slower, that is,
+   a second or more. */
+#define LATENCY_BUCKETS 12
+
+/* Number of buckets in the request size histogram.  Bucket I
+   counts requests of at least 2**I but less than 2**(I + 1)
+   sectors, and the last bucket everything larger. */
+#define SIZE_BUCKETS 8
+
+/* Number of buckets in the seek distance histogram.  Bucket 0
+   counts requests that started where the previous transfer on
+   the device left off, bucket I > 0 those that started at least
+   8**(I - 1) but less than 8**I sectors away, and the last
+   bucket everything farther. */
+#define SEEK_BUCKETS 8
 
 /* A block device. */
 struct block
@@ -16,18 +42,169 @@ struct block
 
     const struct block_operations *ops;  /* Driver operations. */
     void *aux;                          /* Extra data owned by driver. */
+    struct block_channel *channel;      /* Where requests are queued, or
+                                           null if OPS->remap is used. */
+    unsigned id;                        /* Position in probe order. */
 
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
+    block_sector_t head;                /* Sector after the last one
+                                           transferred. */
+
+    /* Histograms of the latency from submission to completion,
+       size, and seek distance of the requests submitted to the
+       device or to devices remapped to it. */
+    unsigned long long latency_hist[LATENCY_BUCKETS];
+    unsigned long long size_hist[SIZE_BUCKETS];
+    unsigned long long seek_hist[SEEK_BUCKETS];
+  };
+
+/* A channel: a queue of requests for one or more block devices
+   that cannot transfer data at the same time, such as the disks
+   on an IDE channel, served by a dispatcher thread of its own.
+   Devices on different channels transfer in parallel. */
+struct block_channel
+  {
+    struct list_elem list_elem;         /* Element in all_channels. */
+    char name[16];                      /* Channel name. */
+
+    struct list queue;                  /* Pending requests, in the
+                                           scheduler's order. */
+    struct list reads, writes;          /* Pending requests, oldest first. */
+    size_t queue_len;                   /* Number of pending requests. */
+    uint64_t head;                      /* Position after the last sector
+                                           transferred. */
+    struct lock lock;                   /* Protects all of the above. */
+    struct condition ready;             /* Signaled when QUEUE grows. */
+
+    unsigned long long request_cnt;     /* Number of requests submitted. */
+    unsigned long long depth_sum;       /* Sum of QUEUE_LEN at submission. */
+    size_t max_depth;                   /* Maximum QUEUE_LEN. */
+    unsigned long long merge_cnt;       /* Requests merged into another. */
+    unsigned long long latency[LATENCY_BUCKETS]; /* Latency histogram. */
+  };
+
+/* An I/O scheduler, which decides the order in which a
+   channel's dispatcher carries out its pending requests.
+
+   Every pending request is in its channel's QUEUE, in an order
+   that is up to the scheduler, and in READS or WRITES in order of
+   submission.  A request's POS orders requests by device, then
+   by sector.  The dispatcher removes the request that NEXT
+   returns, together with any pending requests in the same
+   direction for the sectors that follow it on the same device,
+   up to MERGE_MAX sectors, and transfers the whole run at once.
+
+   Both functions are called with the channel's lock held and
+   NEXT only when the queue is not empty. */
+struct scheduler
+  {
+    const char *name;
+    void (*add) (struct block_channel *, struct block_request *);
+    struct block_request *(*next) (struct block_channel *);
   };
 
+/* Deadline scheduler parameters, in microseconds. */
+#define READ_EXPIRE 50000               /* 50 ms. */
+#define WRITE_EXPIRE 500000             /* 500 ms. */
+
+static void fifo_add (struct block_channel *, struct block_request *);
+static struct block_request *fifo_next (struct block_channel *);
+static void sorted_add (struct block_channel *, struct block_request *);
+static struct block_request *clook_next (struct block_channel *);
+static struct block_request *deadline_next (struct block_channel *);
+
+/* Available schedulers.  The first is the default. */
+static const struct scheduler schedulers[] =
+  {
+    {"deadline", sorted_add, deadline_next},
+    {"clook", sorted_add, clook_next},
+    {"fifo", fifo_add, fifo_next},
+  };
+
+/* Scheduler in use. */
+static const struct scheduler *scheduler = &schedulers[0];
+
 /* List of all block devices. */
 static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 
+/* List of all channels. */
+static struct list all_channels = LIST_INITIALIZER (all_channels);
+
 /* The block block assigned to each Pintos role. */
 static struct block *block_by_role[BLOCK_ROLE_CNT];
 
+/* Request tracing.
+
+   If block_trace_init() is called, a record of each request is
+   kept in memory as the request completes, until the trace
+   buffer fills up.  At shutdown, block_trace_save() writes the
+   trace to the scratch device for offline analysis, in the
+   following format.  All integers are little-endian.
+
+   Sector 0 holds a struct trace_header.  Its DEVICES member
+   gives the name of each block device, indexed by its position
+   in probe order, or an empty string for a device that does not
+   exist.
+
+   The following sectors hold RECORD_CNT struct trace_records,
+   16 per sector, in order of completion.  Times are in
+   microseconds, so the header's TIMER_FREQ is 1000000.  (Version
+   1 traces used timer ticks instead.) */
+
+/* Trace file header. */
+#define TRACE_MAGIC "BLKTRACE"
+#define TRACE_VERSION 2
+#define TRACE_DEVICES 30
+struct trace_header
+  {
+    char magic[8];                      /* TRACE_MAGIC, not terminated. */
+    uint32_t version;                   /* TRACE_VERSION. */
+    uint32_t record_size;               /* sizeof (struct trace_record). */
+    uint32_t record_cnt;                /* Number of records. */
+    uint32_t dropped_cnt;               /* Requests not recorded. */
+    uint32_t timer_freq;                /* Time units per second. */
+    uint32_t device_cnt;                /* Number of block devices. */
+    char devices[TRACE_DEVICES][16];    /* Block device names. */
+  };
+
+/* A traced request. */
+struct trace_record
+  {
+    int64_t submit;                     /* Time when submitted. */
+    int64_t dispatch;                   /* Time when dispatched. */
+    int64_t complete;                   /* Time when completed. */
+    block_sector_t sector;              /* First sector in DEVICE. */
+    uint16_t cnt;                       /* Sectors, at most UINT16_MAX. */
+    uint8_t device;                     /* Device that holds the data. */
+    uint8_t flags;                      /* TRACE_* flags. */
+  };
+#define TRACE_WRITE 0x01                /* Write rather than read. */
+#define TRACE_MERGED 0x02               /* Merged into previous request. */
+
+/* Number of trace records per sector. */
+#define TRACE_PER_SECTOR (BLOCK_SECTOR_SIZE / sizeof (struct trace_record))
+
+static struct trace_record *trace;      /* Trace records, or null. */
+static size_t trace_cnt;                /* Number of records in TRACE. */
+static size_t trace_max;                /* Capacity of TRACE. */
+static size_t trace_dropped;            /* Requests not recorded. */
+static struct lock trace_lock;          /* Protects all of the above. */
+
 static struct block *list_elem_to_block (struct list_elem *);
+static void check_request (struct block *, const struct block_request *);
+static struct block_channel *channel_of (struct block *);
+static thread_func dispatcher NO_RETURN;
+static void dequeue (struct block_channel *, struct block_request *);
+static struct block_request *find_successor (struct block_channel *,
+                                             const struct block_request *,
+                                             size_t cnt);
+static int histogram_bucket (uint64_t value, int shift, int bucket_cnt);
+static void print_histogram (const char *title,
+                             const unsigned long long *buckets,
+                             int bucket_cnt, int shift, unsigned first);
+static void trace_add (const struct block_request *, int64_t now,
+                       bool merged);
 
 /* Returns a human-readable name for the given block device
    TYPE. */
@@ -65,6 +242,39 @@ block_set_role (enum block_type role, struct block *block)
   block_by_role[role] = block;
 }
 
+/* Returns the block device of type ROLE best suited to play
+   that role, or a null pointer if there is none.  Prefers a
+   device whose channel is used by as few of the devices already
+   assigned a role as possible, so that I/O for different roles
+   can proceed in parallel, and among those the first in probe
+   order. */
+struct block *
+block_find_role (enum block_type role)
+{
+  struct block *best = NULL;
+  int best_cnt = BLOCK_ROLE_CNT + 1;
+  struct block *block;
+
+  for (block = block_first (); block != NULL; block = block_next (block))
+    if (block->type == role)
+      {
+        struct block_channel *channel = channel_of (block);
+        int cnt = 0;
+        int i;
+
+        for (i = 0; i < BLOCK_ROLE_CNT; i++)
+          if (block_by_role[i] != NULL
+              && channel_of (block_by_role[i]) == channel)
+            cnt++;
+        if (cnt < best_cnt)
+          {
+            best = block;
+            best_cnt = cnt;
+          }
+      }
+  return best;
+}
+
 /* Returns the first block device in kernel probe order, or a
    null pointer if no block devices are registered. */
 struct block *
@@ -120,9 +330,7 @@ check_sector (struct block *block, block_sector_t sector)
 void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
-  check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
-  block->read_cnt++;
+  block_read_multiple (block, sector, 1, &buffer);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -133,10 +341,114 @@ block_read (struct block *block, block_sector_t sector, void *buffer)
 void
 block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
-  check_sector (block, sector);
-  ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
-  block->write_cnt++;
+  block_write_multiple (block, sector, 1, &buffer);
+}
+
+/* Reads the CNT consecutive sectors of BLOCK that start at
+   SECTOR.  Sector SECTOR + I is read into BUFFERS[I], which must
+   have room for BLOCK_SECTOR_SIZE bytes.  Drivers that support it
+   transfer the whole run with as few commands as possible.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_multiple (struct block *block, block_sector_t sector, size_t cnt,
+                     void *buffers[])
+{
+  struct block_request request;
+
+  if (cnt == 0)
+    return;
+  block_request_init (&request, false, sector, cnt, buffers, NULL, NULL);
+  block_submit (block, &request);
+  block_wait (&request);
+}
+
+/* Writes the CNT consecutive sectors of BLOCK that start at
+   SECTOR.  Sector SECTOR + I is written from BUFFERS[I], which
+   must contain BLOCK_SECTOR_SIZE bytes.  Returns after the block
+   device has acknowledged receiving all of the data.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_multiple (struct block *block, block_sector_t sector,
+                      size_t cnt, const void *buffers[])
+{
+  struct block_request request;
+
+  if (cnt == 0)
+    return;
+
+  /* The request only reads from the buffers of a write. */
+  block_request_init (&request, true, sector, cnt, (void **) buffers,
+                      NULL, NULL);
+  block_submit (block, &request);
+  block_wait (&request);
+}
+
+/* Initializes REQUEST to read (if WRITE is false) or write (if
+   WRITE is true) the CNT consecutive sectors that start at
+   SECTOR, using BUFFERS as block_read_multiple() or
+   block_write_multiple() would.  If DONE is non-null, it will be
+   called with REQUEST when the request completes; otherwise the
+   submitter must wait for it with block_wait().  AUX is stored
+   in REQUEST for DONE's use. */
+void
+block_request_init (struct block_request *request, bool write,
+                    block_sector_t sector, size_t cnt, void **buffers,
+                    block_done_func *done, void *aux)
+{
+  request->write = write;
+  request->sector = sector;
+  request->cnt = cnt;
+  request->buffers = buffers;
+  request->done = done;
+  request->aux = aux;
+  sema_init (&request->complete, 0);
+}
+
+/* Queues REQUEST, which must have been initialized with
+   block_request_init(), for the dispatcher thread of BLOCK's
+   channel and returns without waiting for it to complete.  The
+   caller must not touch REQUEST or its buffers until it
+   completes. */
+void
+block_submit (struct block *block, struct block_request *request)
+{
+  struct block_channel *channel;
+  struct block *target = block;
+  block_sector_t sector = request->sector;
+
+  check_request (block, request);
+
+  /* Find the device that really holds the data. */
+  while (target->ops->remap != NULL)
+    target = target->ops->remap (target->aux, &sector);
+  request->origin = block;
+  request->target = target;
+  request->pos = ((uint64_t) target->id << 32) | sector;
+
+  channel = target->channel;
+  lock_acquire (&channel->lock);
+  request->submit_time = timer_usecs ();
+  scheduler->add (channel, request);
+  list_push_back (request->write ? &channel->writes : &channel->reads,
+                  &request->fifo_elem);
+  channel->queue_len++;
+  channel->request_cnt++;
+  channel->depth_sum += channel->queue_len;
+  if (channel->queue_len > channel->max_depth)
+    channel->max_depth = channel->queue_len;
+  cond_signal (&channel->ready, &channel->lock);
+  lock_release (&channel->lock);
+}
+
+/* Waits for REQUEST, which was submitted without a completion
+   function, to complete. */
+void
+block_wait (struct block_request *request)
+{
+  ASSERT (request->done == NULL);
+  sema_down (&request->complete);
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -160,10 +472,14 @@ block_type (struct block *block)
   return block->type;
 }
 
-/* Prints statistics for each block device used for a Pintos role. */
+/* Prints statistics for each block device used for a Pintos
+   role, with histograms of its requests' latency, size, and seek
+   distance, and for each channel that has carried out
+   requests. */
 void
 block_print_stats (void)
 {
+  struct list_elem *e;
   int i;
 
   for (i = 0; i < BLOCK_ROLE_CNT; i++)
@@ -174,32 +490,270 @@ block_print_stats (void)
           printf ("%s (%s): %llu reads, %llu writes\n",
                   block->name, block_type_name (block->type),
                   block->read_cnt, block->write_cnt);
+          if (block->read_cnt + block->write_cnt == 0)
+            continue;
+          print_histogram ("latency (us)", block->latency_hist,
+                           LATENCY_BUCKETS, 2, 1);
+          print_histogram ("size (sectors)", block->size_hist, SIZE_BUCKETS,
+                           1, 2);
+          print_histogram ("seek (sectors)", block->seek_hist, SEEK_BUCKETS,
+                           3, 1);
         }
     }
+
+  for (e = list_begin (&all_channels); e != list_end (&all_channels);
+       e = list_next (e))
+    {
+      struct block_channel *channel
+        = list_entry (e, struct block_channel, list_elem);
+      unsigned long long avg_depth;
+
+      if (channel->request_cnt == 0)
+        continue;
+      avg_depth = channel->depth_sum * 10 / channel->request_cnt;
+      printf ("%s: %s scheduler, %llu requests, %llu merged, "
+              "queue depth %llu.%llu avg, %zu max\n",
+              channel->name, scheduler->name, channel->request_cnt,
+              channel->merge_cnt, avg_depth / 10, avg_depth % 10,
+              channel->max_depth);
+      print_histogram ("latency (us)", channel->latency, LATENCY_BUCKETS,
+                       2, 1);
+    }
+}
+
+/* Returns the histogram bucket for VALUE, in a histogram of
+   BUCKET_CNT buckets in which bucket 0 holds 0 and each of the
+   others covers values 2**SHIFT times as large as the one
+   before. */
+static int
+histogram_bucket (uint64_t value, int shift, int bucket_cnt)
+{
+  int bucket = 0;
+
+  while (value > 0 && bucket < bucket_cnt - 1)
+    {
+      value >>= shift;
+      bucket++;
+    }
+  return bucket;
+}
+
+/* Prints histogram BUCKETS, which has BUCKET_CNT buckets, on a
+   line headed by TITLE.  Each bucket but the last is labeled
+   with the upper bound of its values, FIRST for bucket 0 and
+   2**SHIFT times the previous bound for each of the others. */
+static void
+print_histogram (const char *title, const unsigned long long *buckets,
+                 int bucket_cnt, int shift, unsigned first)
+{
+  unsigned long long bound = first;
+  int i;
+
+  printf ("  %s:", title);
+  for (i = 0; i < bucket_cnt - 1; i++, bound <<= shift)
+    printf (" <%llu: %llu", bound, buckets[i]);
+  printf (" more: %llu\n", buckets[bucket_cnt - 1]);
+}
+
+/* Starts tracing block requests, keeping up to RECORD_CNT
+   records in memory.  Requests that complete after that many
+   have been recorded are only counted.  The trace is written to
+   the scratch device by block_trace_save(). */
+void
+block_trace_init (size_t record_cnt)
+{
+  lock_init (&trace_lock);
+  if (record_cnt == 0)
+    return;
+
+  /* Round up to whole sectors, so that block_trace_save() can
+     write straight from the buffer. */
+  record_cnt = ROUND_UP (record_cnt, TRACE_PER_SECTOR);
+  trace = calloc (record_cnt, sizeof *trace);
+  if (trace == NULL)
+    {
+      printf ("blktrace: not enough memory for %zu records\n",
+              record_cnt);
+      return;
+    }
+  trace_max = record_cnt;
+}
+
+/* Adds a record of REQUEST, which completed at time NOW, to the
+   trace.  MERGED should be true if REQUEST was carried out as
+   part of the same transfer as the request before it. */
+static void
+trace_add (const struct block_request *request, int64_t now, bool merged)
+{
+  struct trace_record *t;
+
+  if (trace == NULL)
+    return;
+
+  lock_acquire (&trace_lock);
+  if (trace == NULL)
+    {
+      /* Tracing stopped while we waited for the lock. */
+    }
+  else if (trace_cnt < trace_max)
+    {
+      t = &trace[trace_cnt++];
+      t->submit = request->submit_time;
+      t->dispatch = request->dispatch_time;
+      t->complete = now;
+      t->sector = (block_sector_t) request->pos;
+      t->cnt = request->cnt < UINT16_MAX ? request->cnt : UINT16_MAX;
+      t->device = request->target->id;
+      t->flags = ((request->write ? TRACE_WRITE : 0)
+                  | (merged ? TRACE_MERGED : 0));
+    }
+  else
+    trace_dropped++;
+  lock_release (&trace_lock);
+}
+
+/* Stops tracing and writes the trace to the scratch device, if
+   tracing was started by block_trace_init().  Records that do
+   not fit on the device are dropped. */
+void
+block_trace_save (void)
+{
+  static struct trace_header header;
+  struct block *scratch = block_get_role (BLOCK_SCRATCH);
+  struct trace_record *records = trace;
+  uint8_t sector[BLOCK_SECTOR_SIZE];
+  size_t sector_cnt, i;
+  struct block *b;
+
+  if (records == NULL)
+    return;
+
+  /* Stop tracing. */
+  lock_acquire (&trace_lock);
+  trace = NULL;
+  lock_release (&trace_lock);
+
+  if (scratch == NULL)
+    {
+      printf ("blktrace: no scratch device, trace discarded\n");
+      return;
+    }
+  sector_cnt = DIV_ROUND_UP (trace_cnt, TRACE_PER_SECTOR);
+  if (sector_cnt > block_size (scratch) - 1)
+    {
+      sector_cnt = block_size (scratch) - 1;
+      trace_dropped += trace_cnt - sector_cnt * TRACE_PER_SECTOR;
+      trace_cnt = sector_cnt * TRACE_PER_SECTOR;
+    }
+
+  ASSERT (sizeof header <= sizeof sector);
+  memcpy (header.magic, TRACE_MAGIC, sizeof header.magic);
+  header.version = TRACE_VERSION;
+  header.record_size = sizeof *records;
+  header.record_cnt = trace_cnt;
+  header.dropped_cnt = trace_dropped;
+  header.timer_freq = 1000000;
+  header.device_cnt = 0;
+  for (b = block_first (); b != NULL; b = block_next (b))
+    {
+      if (b->id < TRACE_DEVICES)
+        strlcpy (header.devices[b->id], b->name, sizeof header.devices[0]);
+      header.device_cnt++;
+    }
+  memset (sector, 0, sizeof sector);
+  memcpy (sector, &header, sizeof header);
+  block_write (scratch, 0, sector);
+
+  for (i = 0; i < sector_cnt; )
+    {
+      const void *buffers[MERGE_MAX];
+      size_t cnt = sector_cnt - i < MERGE_MAX ? sector_cnt - i : MERGE_MAX;
+      size_t j;
+
+      for (j = 0; j < cnt; j++)
+        buffers[j] = records + (i + j) * TRACE_PER_SECTOR;
+      block_write_multiple (scratch, i + 1, cnt, buffers);
+      i += cnt;
+    }
+
+  printf ("blktrace: %zu requests traced to %s, %zu dropped\n",
+          trace_cnt, block_name (scratch), trace_dropped);
+}
+
+/* Creates and returns a new channel named NAME, with a
+   dispatcher thread of its own. */
+struct block_channel *
+block_channel_create (const char *name)
+{
+  struct block_channel *channel = malloc (sizeof *channel);
+  if (channel == NULL)
+    PANIC ("Failed to allocate memory for block channel");
+
+  list_push_back (&all_channels, &channel->list_elem);
+  strlcpy (channel->name, name, sizeof channel->name);
+  list_init (&channel->queue);
+  list_init (&channel->reads);
+  list_init (&channel->writes);
+  channel->queue_len = 0;
+  channel->head = 0;
+  lock_init (&channel->lock);
+  cond_init (&channel->ready);
+  channel->request_cnt = 0;
+  channel->depth_sum = 0;
+  channel->max_depth = 0;
+  channel->merge_cnt = 0;
+  memset (channel->latency, 0, sizeof channel->latency);
+
+  /* The dispatcher asks for PRI_MAX, but the scheduler is round
+     robin and ignores priorities, so once a completion wakes it,
+     it waits its turn on the ready list like any other thread.
+     Requests queued meanwhile are not lost, only started later. */
+  if (thread_create (channel->name, PRI_MAX, dispatcher, channel)
+      == TID_ERROR)
+    PANIC ("Failed to create dispatcher for block channel %s",
+           channel->name);
+
+  return channel;
 }
 
 /* Registers a new block device with the given NAME.  If
    EXTRA_INFO is non-null, it is printed as part of a user
    message.  The block device's SIZE in sectors and its TYPE must
    be provided, as well as the it operation functions OPS, which
-   will be passed AUX in each function call. */
+   will be passed AUX in each function call.
+   Requests for the device are queued on CHANNEL, or on a new
+   channel of its own if CHANNEL is null.  Devices whose OPS
+   remap their requests to another device take that device's
+   channel instead, so CHANNEL must be null for them. */
 struct block *
 block_register (const char *name, enum block_type type,
                 const char *extra_info, block_sector_t size,
-                const struct block_operations *ops, void *aux)
+                const struct block_operations *ops, void *aux,
+                struct block_channel *channel)
 {
+  static unsigned next_id;
   struct block *block = malloc (sizeof *block);
   if (block == NULL)
     PANIC ("Failed to allocate memory for block device descriptor");
 
+  ASSERT (ops->remap == NULL || channel == NULL);
+
   list_push_back (&all_blocks, &block->list_elem);
   strlcpy (block->name, name, sizeof block->name);
   block->type = type;
   block->size = size;
   block->ops = ops;
   block->aux = aux;
+  block->id = next_id++;
   block->read_cnt = 0;
   block->write_cnt = 0;
+  block->head = 0;
+  memset (block->latency_hist, 0, sizeof block->latency_hist);
+  memset (block->size_hist, 0, sizeof block->size_hist);
+  memset (block->seek_hist, 0, sizeof block->seek_hist);
+  if (channel == NULL && ops->remap == NULL)
+    channel = block_channel_create (name);
+  block->channel = channel;
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
@@ -210,7 +764,320 @@ block_register (const char *name, enum block_type type,
 
   return block;
 }
-
+
+/* Returns the channel on which requests for BLOCK are queued. */
+static struct block_channel *
+channel_of (struct block *block)
+{
+  block_sector_t sector = 0;
+
+  while (block->ops->remap != NULL)
+    block = block->ops->remap (block->aux, &sector);
+  return block->channel;
+}
+
+/* Verifies that REQUEST is a valid request for BLOCK.
+   Panics if not. */
+static void
+check_request (struct block *block, const struct block_request *request)
+{
+  ASSERT (request->cnt > 0);
+  ASSERT (!request->write || block->type != BLOCK_FOREIGN);
+  check_sector (block, request->sector);
+  check_sector (block, request->sector + request->cnt - 1);
+}
+
+/* Carries out a transfer of the CNT sectors starting at SECTOR
+   on BLOCK with BLOCK's driver, as block_read_multiple() or, if
+   WRITE is true, block_write_multiple(). */
+static void
+execute (struct block *block, bool write, block_sector_t sector,
+         size_t cnt, void **buffers)
+{
+  const struct block_operations *ops = block->ops;
+  size_t i;
+
+  if (!write)
+    {
+      if (ops->read_multiple != NULL)
+        ops->read_multiple (block->aux, sector, cnt, buffers);
+      else
+        for (i = 0; i < cnt; i++)
+          ops->read (block->aux, sector + i, buffers[i]);
+    }
+  else
+    {
+      const void **write_buffers = (const void **) buffers;
+      if (ops->write_multiple != NULL)
+        ops->write_multiple (block->aux, sector, cnt, write_buffers);
+      else
+        for (i = 0; i < cnt; i++)
+          ops->write (block->aux, sector + i, write_buffers[i]);
+    }
+}
+
+/* Carries out the requests in RUN, which cover CNT consecutive
+   sectors of one device in ascending order, with a single
+   transfer. */
+static void
+execute_run (struct list *run, size_t cnt)
+{
+  struct block_request *first = list_entry (list_front (run),
+                                            struct block_request, elem);
+  void **buffers = first->buffers;
+  void *merged[MERGE_MAX];
+
+  if (first->cnt < cnt)
+    {
+      struct list_elem *e;
+      size_t i = 0;
+
+      ASSERT (cnt <= MERGE_MAX);
+      for (e = list_begin (run); e != list_end (run); e = list_next (e))
+        {
+          struct block_request *r = list_entry (e, struct block_request,
+                                                elem);
+          size_t j;
+
+          for (j = 0; j < r->cnt; j++)
+            merged[i++] = r->buffers[j];
+        }
+      buffers = merged;
+    }
+  execute (first->target, first->write, (block_sector_t) first->pos, cnt,
+           buffers);
+}
+
+/* Accounts for REQUEST, which was carried out by CHANNEL's
+   dispatcher, and reports its completion.  MERGED should be true
+   if REQUEST was carried out as part of the same transfer as the
+   request completed before it. */
+static void
+complete (struct block_channel *channel, struct block_request *request,
+          bool merged)
+{
+  struct block *b;
+  int64_t now = timer_usecs ();
+  int latency = histogram_bucket (now - request->submit_time, 2,
+                                  LATENCY_BUCKETS);
+  int size = histogram_bucket (request->cnt >> 1, 1, SIZE_BUCKETS);
+  int seek = histogram_bucket (request->seek, 3, SEEK_BUCKETS);
+
+  channel->latency[latency]++;
+  for (b = request->origin; ; b = request->target)
+    {
+      if (request->write)
+        b->write_cnt += request->cnt;
+      else
+        b->read_cnt += request->cnt;
+      b->latency_hist[latency]++;
+      b->size_hist[size]++;
+      b->seek_hist[seek]++;
+      if (b == request->target)
+        break;
+    }
+  trace_add (request, now, merged);
+
+  if (request->done != NULL)
+    request->done (request);
+  else
+    sema_up (&request->complete);
+}
+
+/* Dispatcher thread for channel CHANNEL_.  Carries out the
+   requests in its queue in the order chosen by the I/O
+   scheduler, merging requests for consecutive sectors, and
+   reports each one's completion. */
+static void
+dispatcher (void *channel_)
+{
+  struct block_channel *channel = channel_;
+
+  for (;;)
+    {
+      struct block_request *first, *r;
+      struct block *target;
+      block_sector_t sector;
+      struct list run;
+      struct list_elem *e;
+      int64_t now;
+      size_t cnt;
+
+      lock_acquire (&channel->lock);
+      while (list_empty (&channel->queue))
+        cond_wait (&channel->ready, &channel->lock);
+
+      /* Take the request the scheduler picks, along with any
+         queued requests that continue it. */
+      first = scheduler->next (channel);
+      dequeue (channel, first);
+      list_init (&run);
+      list_push_back (&run, &first->elem);
+      cnt = first->cnt;
+      while ((r = find_successor (channel, first, cnt)) != NULL)
+        {
+          dequeue (channel, r);
+          list_push_back (&run, &r->elem);
+          cnt += r->cnt;
+          channel->merge_cnt++;
+        }
+      channel->head = first->pos + cnt;
+
+      /* Note how far the device's head moves to get to the run.
+         The rest of the run follows without a seek. */
+      target = first->target;
+      sector = (block_sector_t) first->pos;
+      now = timer_usecs ();
+      for (e = list_begin (&run); e != list_end (&run); e = list_next (e))
+        {
+          r = list_entry (e, struct block_request, elem);
+          r->dispatch_time = now;
+          r->seek = 0;
+        }
+      first->seek = (sector >= target->head
+                     ? sector - target->head : target->head - sector);
+      target->head = sector + cnt;
+      lock_release (&channel->lock);
+
+      execute_run (&run, cnt);
+      while (!list_empty (&run))
+        {
+          r = list_entry (list_pop_front (&run), struct block_request, elem);
+          complete (channel, r, r != first);
+        }
+    }
+}
+
+/* Removes REQUEST from CHANNEL's queues.  CHANNEL's lock must be
+   held. */
+static void
+dequeue (struct block_channel *channel, struct block_request *request)
+{
+  list_remove (&request->elem);
+  list_remove (&request->fifo_elem);
+  channel->queue_len--;
+}
+
+/* Returns a queued request in the same direction as FIRST that
+   starts right after the CNT sectors starting at FIRST's, on the
+   same device, if there is one that can be merged with them
+   without exceeding MERGE_MAX sectors.  Otherwise returns a null
+   pointer.  CHANNEL's lock must be held. */
+static struct block_request *
+find_successor (struct block_channel *channel,
+                const struct block_request *first, size_t cnt)
+{
+  struct list_elem *e;
+
+  if (cnt >= MERGE_MAX)
+    return NULL;
+  for (e = list_begin (&channel->queue); e != list_end (&channel->queue);
+       e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      if (r->write == first->write && r->target == first->target
+          && r->pos == first->pos + cnt && cnt + r->cnt <= MERGE_MAX)
+        return r;
+    }
+  return NULL;
+}
+
+/* Sets the I/O scheduler used by all block devices to the one
+   named NAME and returns true, or returns false if there is no
+   such scheduler.  Should be called before any I/O is done. */
+bool
+block_set_scheduler (const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof schedulers / sizeof *schedulers; i++)
+    if (!strcmp (name, schedulers[i].name))
+      {
+        scheduler = &schedulers[i];
+        return true;
+      }
+  return false;
+}
+
+/* FIFO scheduler: carries out requests in arrival order. */
+
+static void
+fifo_add (struct block_channel *channel, struct block_request *request)
+{
+  list_push_back (&channel->queue, &request->elem);
+}
+
+static struct block_request *
+fifo_next (struct block_channel *channel)
+{
+  return list_entry (list_front (&channel->queue),
+                     struct block_request, elem);
+}
+
+/* C-LOOK elevator: keeps requests sorted by sector and sweeps
+   upward from the last sector transferred, then jumps back to
+   the lowest pending request. */
+
+/* Returns true if request A starts before request B. */
+static bool
+pos_less (const struct list_elem *a_, const struct list_elem *b_,
+          void *aux UNUSED)
+{
+  const struct block_request *a = list_entry (a_, struct block_request, elem);
+  const struct block_request *b = list_entry (b_, struct block_request, elem);
+  return a->pos < b->pos;
+}
+
+static void
+sorted_add (struct block_channel *channel, struct block_request *request)
+{
+  list_insert_ordered (&channel->queue, &request->elem, pos_less, NULL);
+}
+
+static struct block_request *
+clook_next (struct block_channel *channel)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&channel->queue); e != list_end (&channel->queue);
+       e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      if (r->pos >= channel->head)
+        return r;
+    }
+  return list_entry (list_front (&channel->queue),
+                     struct block_request, elem);
+}
+
+/* Deadline scheduler: C-LOOK, except that a read that has waited
+   READ_EXPIRE microseconds, or a write that has waited
+   WRITE_EXPIRE microseconds, goes next regardless of its
+   position.  Reads expire sooner because threads usually wait
+   for them, so that a stream of writes cannot starve them. */
+
+static struct block_request *
+deadline_next (struct block_channel *channel)
+{
+  struct block_request *r;
+
+  if (!list_empty (&channel->reads))
+    {
+      r = list_entry (list_front (&channel->reads),
+                      struct block_request, fifo_elem);
+      if (timer_usecs () - r->submit_time >= READ_EXPIRE)
+        return r;
+    }
+  if (!list_empty (&channel->writes))
+    {
+      r = list_entry (list_front (&channel->writes),
+                      struct block_request, fifo_elem);
+      if (timer_usecs () - r->submit_time >= WRITE_EXPIRE)
+        return r;
+    }
+  return clook_next (channel);
+}
+
 /* Returns the block device corresponding to LIST_ELEM, or a null
    pointer if LIST_ELEM is the list end of all_blocks. */
 static struct block *
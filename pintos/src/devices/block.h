@@ -3,6 +3,9 @@
 
 #include <stddef.h>
 #include <inttypes.h>
+#include <list.h>
+#include <stdbool.h>
+#include "threads/synch.h"
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -21,6 +24,7 @@ typedef uint32_t block_sector_t;
 /* Higher-level interface for file systems, etc. */
 
 struct block;
+struct block_channel;
 
 /* Type of a block device. */
 enum block_type
@@ -45,6 +49,7 @@ const char *block_type_name (enum block_type);
 struct block *block_get_role (enum block_type);
 void block_set_role (enum block_type, struct block *);
 struct block *block_get_by_name (const char *name);
+struct block *block_find_role (enum block_type);
 
 struct block *block_first (void);
 struct block *block_next (struct block *);
@@ -53,22 +58,95 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, size_t cnt,
+                          void *buffers[]);
+void block_write_multiple (struct block *, block_sector_t, size_t cnt,
+                           const void *buffers[]);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
-/* Statistics. */
+/* Asynchronous block device operations.
+
+   block_submit() queues a request for the device's dispatcher
+   thread and returns at once.  When the transfer is done, the
+   dispatcher calls the request's DONE function, if there is
+   one, and otherwise ups its COMPLETE semaphore so that the
+   submitter can wait for it with block_wait().  The synchronous
+   operations above are built on these. */
+
+struct block_request;
+
+/* Called by a dispatcher thread when REQUEST is done.  From
+   then on REQUEST belongs to the callee again, so it may be
+   freed or resubmitted. */
+typedef void block_done_func (struct block_request *request);
+
+/* A request to transfer a run of consecutive sectors. */
+struct block_request
+  {
+    struct list_elem elem;              /* Element in device queue. */
+    bool write;                         /* Write rather than read? */
+    block_sector_t sector;              /* First sector. */
+    size_t cnt;                         /* Number of sectors. */
+    void **buffers;                     /* One buffer per sector. */
+    block_done_func *done;              /* Callback, or null. */
+    void *aux;                          /* For use by DONE. */
+    struct semaphore complete;          /* Up'd when done if DONE is null. */
+
+    /* Owned by the block layer while the request is pending. */
+    struct list_elem fifo_elem;         /* Element in arrival-order queue. */
+    int64_t submit_time;                /* Microseconds when submitted. */
+    struct block *origin;               /* Device submitted to. */
+    struct block *target;               /* Device that holds the data. */
+    uint64_t pos;                       /* TARGET's number in the high 32
+                                           bits, sector in TARGET in the
+                                           low 32 bits. */
+    int64_t dispatch_time;              /* Microseconds when dispatched. */
+    block_sector_t seek;                /* Sectors TARGET's head moved to
+                                           reach the request. */
+  };
+
+void block_request_init (struct block_request *, bool write,
+                         block_sector_t, size_t cnt, void **buffers,
+                         block_done_func *, void *aux);
+void block_submit (struct block *, struct block_request *);
+void block_wait (struct block_request *);
+
+/* I/O scheduling. */
+bool block_set_scheduler (const char *name);
+
+/* Statistics and tracing. */
 void block_print_stats (void);
+void block_trace_init (size_t record_cnt);
+void block_trace_save (void);
 
 /* Lower-level interface to block device drivers. */
 
+/* READ_MULTIPLE and WRITE_MULTIPLE may be null, in which case
+   multi-sector transfers are done one sector at a time with READ
+   and WRITE.
+
+   A device that is a part of another device, such as a
+   partition, instead provides REMAP, which adjusts *SECTOR to
+   the corresponding sector of the underlying device and returns
+   that device.  Requests for it are then queued for the
+   underlying device directly and the other operations are not
+   used. */
 struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+    void (*read_multiple) (void *aux, block_sector_t, size_t cnt,
+                           void *buffers[]);
+    void (*write_multiple) (void *aux, block_sector_t, size_t cnt,
+                            const void *buffers[]);
+    struct block *(*remap) (void *aux, block_sector_t *sector);
   };
 
+struct block_channel *block_channel_create (const char *name);
 struct block *block_register (const char *name, enum block_type,
                               const char *extra_info, block_sector_t size,
-                              const struct block_operations *, void *aux);
+                              const struct block_operations *, void *aux,
+                              struct block_channel *);
 
 #endif /* devices/block.h */
@@ -8,10 +8,26 @@
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
-   controller.  It attempts to comply to [ATA-3]. */
+   controller.  It attempts to comply to [ATA-3].
+
+   If the controller is a PCI bus-master IDE controller, such as
+   the PIIX that QEMU emulates, disks that support it transfer
+   data by DMA, so that the CPU can run other threads while a
+   transfer is in progress.  Otherwise, and whenever a DMA
+   transfer fails, we fall back to programmed I/O.
+
+   Command completion is signaled by the disk's interrupt.  A
+   thread waiting for one sleeps until it arrives or until
+   INTERRUPT_TIMEOUT passes, whichever comes first.  The status
+   register is only polled where the interrupt does not tell us
+   what we need to know, and then we busy-wait briefly before
+   resorting to sleeping, since a disk that has just interrupted
+   is almost always ready already. */
 
 /* ATA command block port addresses. */
 #define reg_data(CHANNEL) ((CHANNEL)->reg_base + 0)     /* Data. */
@@ -34,6 +50,7 @@
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +66,59 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+
+/* Maximum number of sectors transferred by a single command.
+   A sector count register value of 0 means this many. */
+#define MAX_COMMAND_SECTORS 256
+
+/* Additional commands for DMA. */
+#define CMD_READ_DMA 0xc8               /* READ DMA with retries. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA with retries. */
+
+/* Bus master IDE port addresses, relative to the channel's
+   bus master base. */
+#define bm_command(CHANNEL) ((CHANNEL)->bm_base + 0)    /* Command. */
+#define bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)     /* Status. */
+#define bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)       /* PRD table. */
+
+/* Bus master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start transfer. */
+#define BM_CMD_READ 0x08        /* Transfer from disk to memory. */
+
+/* Bus master Status Register bits.  Writing 1 clears them. */
+#define BM_STA_ERR 0x02         /* Error. */
+#define BM_STA_INTR 0x04        /* Interrupt. */
+
+/* Timer ticks to wait for a command's completion interrupt
+   before giving up on it.  The ATA standards allow a disk as
+   long as 30 seconds to spin up. */
+#define INTERRUPT_TIMEOUT (30 * TIMER_FREQ)
+
+/* Microseconds to busy-wait for BSY to clear before sleeping. */
+#define BUSY_SPIN_USECS 1000
+
+/* IDENTIFY DEVICE capabilities bits (word 49). */
+#define CAP_DMA 0x0100          /* DMA supported. */
+
+/* A physical region descriptor, an entry in a bus master's PRD
+   table.  Describes one region of physical memory that takes
+   part in a DMA transfer.  A region may not cross a 64 kB
+   boundary. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address. */
+    uint16_t size;              /* Size in bytes, 0 meaning 64 kB. */
+    uint16_t flags;             /* PRD_EOT on the last entry. */
+  };
+#define PRD_EOT 0x8000          /* End of table. */
+
+/* Number of PRDs in a channel's table, which occupies one page,
+   enough for MAX_COMMAND_SECTORS sectors even if each one
+   straddles a 64 kB boundary. */
+#define PRD_CNT (PGSIZE / sizeof (struct prd))
 
 /* An ATA device. */
 struct ata_disk
@@ -57,6 +127,9 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    int multiple_cnt;           /* Sectors per interrupt for READ/WRITE
+                                   MULTIPLE, or 1 if not supported. */
+    bool use_dma;               /* Transfer data by DMA? */
   };
 
 /* An ATA channel (aka controller).
@@ -66,11 +139,20 @@ struct channel
     char name[8];               /* Name, e.g. "ide0". */
     uint16_t reg_base;          /* Base I/O port. */
     uint8_t irq;                /* Interrupt in use. */
+    uint16_t bm_base;           /* Bus master base port, or 0 if none. */
+    struct block_channel *queue; /* Block layer queue for the disks. */
+    struct prd *prdt;           /* Bus master PRD table. */
 
     struct lock lock;           /* Must acquire to access the controller. */
     bool expecting_interrupt;   /* True if an interrupt is expected, false if
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
+    int selected;               /* Selected device, or -1 if unknown. */
+
+    /* Statistics. */
+    long long interrupt_cnt;    /* Completion interrupts received. */
+    long long slow_wait_cnt;    /* Status waits that had to sleep. */
+    long long timeout_cnt;      /* Interrupts that never arrived. */
 
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
@@ -81,15 +163,31 @@ static struct channel channels[CHANNEL_CNT];
 
 static struct block_operations ide_operations;
 
+static uint16_t find_bus_master (void);
 static void reset_channel (struct channel *);
+static void recover_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void set_multiple_mode (struct ata_disk *, int multiple_cnt);
+static void select_sector (struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
-
+static size_t transfer_cnt (const struct ata_disk *, size_t cnt);
+
+static void ide_read_multiple (void *, block_sector_t, size_t cnt,
+                               void *buffers[]);
+static void ide_write_multiple (void *, block_sector_t, size_t cnt,
+                                const void *buffers[]);
+static void pio_read (struct ata_disk *, block_sector_t, size_t cnt,
+                      void *buffers[]);
+static void pio_write (struct ata_disk *, block_sector_t, size_t cnt,
+                       const void *buffers[]);
+static bool dma_transfer (struct ata_disk *, block_sector_t, size_t cnt,
+                          const void *buffers[], bool is_read);
+
+static bool wait_for_interrupt (struct channel *);
 static void wait_until_idle (const struct ata_disk *);
 static bool wait_while_busy (const struct ata_disk *);
 static void select_device (const struct ata_disk *);
@@ -97,10 +195,24 @@ static void select_device_wait (const struct ata_disk *);
 
 static void interrupt_handler (struct intr_frame *);
 
+/* Prints statistics about each channel's interrupts. */
+void
+ide_print_stats (void)
+{
+  struct channel *c;
+
+  for (c = channels; c < channels + CHANNEL_CNT; c++)
+    if (c->interrupt_cnt > 0 || c->timeout_cnt > 0)
+      printf ("%s: %lld interrupts, %lld slow status waits, "
+              "%lld timeouts\n",
+              c->name, c->interrupt_cnt, c->slow_wait_cnt, c->timeout_cnt);
+}
+
 /* Initialize the disk subsystem and detect disks. */
 void
 ide_init (void) 
 {
+  uint16_t bm_base = find_bus_master ();
   size_t chan_no;
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
@@ -123,9 +235,20 @@ ide_init (void)
         default:
           NOT_REACHED ();
         }
+      c->queue = block_channel_create (c->name);
+      c->bm_base = 0;
+      c->prdt = NULL;
+      if (bm_base != 0)
+        {
+          c->prdt = palloc_get_page (0);
+          if (c->prdt != NULL)
+            c->bm_base = bm_base + chan_no * 8;
+        }
       lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      c->selected = -1;
+      c->interrupt_cnt = c->slow_wait_cnt = c->timeout_cnt = 0;
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +259,8 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multiple_cnt = 1;
+          d->use_dma = false;
         }
 
       /* Register interrupt handler. */
@@ -159,6 +284,67 @@ ide_init (void)
 
 static char *descramble_ata_string (char *, int size);
 
+/* PCI configuration space ports. */
+#define PCI_CONFIG_ADDR 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+
+/* Returns the 32-bit register at byte offset REG in the PCI
+   configuration space of function FUNC of device DEV on bus 0. */
+static uint32_t
+pci_read_config (int dev, int func, int reg)
+{
+  outl (PCI_CONFIG_ADDR, 0x80000000 | (dev << 11) | (func << 8) | reg);
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Sets the 32-bit register at byte offset REG in the PCI
+   configuration space of function FUNC of device DEV on bus 0 to
+   VALUE. */
+static void
+pci_write_config (int dev, int func, int reg, uint32_t value)
+{
+  outl (PCI_CONFIG_ADDR, 0x80000000 | (dev << 11) | (func << 8) | reg);
+  outl (PCI_CONFIG_DATA, value);
+}
+
+/* Looks on PCI bus 0 for a bus-master IDE controller that runs
+   both channels at the legacy addresses, which is all that we
+   support.  If one is found, enables bus mastering and returns
+   the base port of its bus master registers.  Otherwise, returns
+   0. */
+static uint16_t
+find_bus_master (void)
+{
+  int dev, func;
+
+  for (dev = 0; dev < 32; dev++)
+    for (func = 0; func < 8; func++)
+      {
+        uint32_t class, bar4;
+
+        if ((pci_read_config (dev, func, 0x00) & 0xffff) == 0xffff)
+          continue;
+
+        /* Class 01 (mass storage), subclass 01 (IDE), with
+           programming interface bit 7 (bus master) set and bits
+           0 and 2 (native mode channels) clear. */
+        class = pci_read_config (dev, func, 0x08) >> 8;
+        if ((class & 0xffff00) != 0x010100 || (class & 0x85) != 0x80)
+          continue;
+
+        /* BAR4 holds the bus master base in I/O space. */
+        bar4 = pci_read_config (dev, func, 0x20);
+        if ((bar4 & 1) == 0 || (bar4 & 0xfffc) == 0)
+          continue;
+
+        /* Enable I/O space and bus mastering. */
+        pci_write_config (dev, func, 0x04,
+                          pci_read_config (dev, func, 0x04) | 0x05);
+        return bar4 & 0xfffc;
+      }
+  return 0;
+}
+
 /* Resets an ATA channel and waits for any devices present on it
    to finish the reset. */
 static void
@@ -195,6 +381,7 @@ reset_channel (struct channel *c)
   outb (reg_ctl (c), CTL_SRST);
   timer_usleep (10);
   outb (reg_ctl (c), 0);
+  c->selected = 0;
 
   timer_msleep (150);
 
@@ -221,6 +408,23 @@ reset_channel (struct channel *c)
     }
 }
 
+/* Resets channel C after a command on it failed to complete,
+   so that its devices are idle and ready for new commands, and
+   restores the settings that a reset may undo. */
+static void
+recover_channel (struct channel *c)
+{
+  int multiple_cnt[2];
+  int dev_no;
+
+  for (dev_no = 0; dev_no < 2; dev_no++)
+    multiple_cnt[dev_no] = c->devices[dev_no].multiple_cnt;
+  reset_channel (c);
+  for (dev_no = 0; dev_no < 2; dev_no++)
+    if (c->devices[dev_no].is_ata)
+      set_multiple_mode (&c->devices[dev_no], multiple_cnt[dev_no]);
+}
+
 /* Checks whether device D is an ATA disk and sets D's is_ata
    member appropriately.  If D is device 0 (master), returns true
    if it's possible that a slave (device 1) exists on this
@@ -273,8 +477,7 @@ identify_ata_device (struct ata_disk *d)
      into our buffer. */
   select_device_wait (d);
   issue_pio_command (c, CMD_IDENTIFY_DEVICE);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
+  if (!wait_for_interrupt (c) || !wait_while_busy (d))
     {
       d->is_ata = false;
       return;
@@ -284,10 +487,14 @@ identify_ata_device (struct ata_disk *d)
   /* Calculate capacity.
      Read model name and serial number. */
   capacity = *(uint32_t *) &id[60 * 2];
+  set_multiple_mode (d, (uint8_t) id[47 * 2]);
+  d->use_dma = (c->bm_base != 0
+                && (*(uint16_t *) &id[49 * 2] & CAP_DMA) != 0);
   model = descramble_ata_string (&id[10 * 2], 20);
   serial = descramble_ata_string (&id[27 * 2], 40);
   snprintf (extra_info, sizeof extra_info,
-            "model \"%s\", serial \"%s\"", model, serial);
+            "model \"%s\", serial \"%s\"%s",
+            model, serial, d->use_dma ? ", DMA" : "");
 
   /* Disable access to IDE disks over 1 GB, which are likely
      physical IDE disks rather than virtual ones.  If we don't
@@ -305,7 +512,7 @@ identify_ata_device (struct ata_disk *d)
 
   /* Register. */
   block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
-                          &ide_operations, d);
+                          &ide_operations, d, c->queue);
   partition_scan (block);
 }
 
@@ -337,63 +544,289 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
+/* Enables READ MULTIPLE and WRITE MULTIPLE on disk D with
+   MULTIPLE_CNT sectors per interrupt, the maximum reported by
+   IDENTIFY DEVICE.  If D does not support them, falls back to one
+   sector per interrupt. */
+static void
+set_multiple_mode (struct ata_disk *d, int multiple_cnt)
+{
+  struct channel *c = d->channel;
+
+  d->multiple_cnt = 1;
+  if (multiple_cnt <= 1)
+    return;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), multiple_cnt);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  if (!wait_for_interrupt (c))
+    return;
+  wait_while_busy (d);
+  if ((inb (reg_alt_status (c)) & STA_ERR) == 0)
+    d->multiple_cnt = multiple_cnt;
+}
+
 /* Reads sector SEC_NO from disk D into BUFFER, which must have
    room for BLOCK_SECTOR_SIZE bytes.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_read (void *d, block_sector_t sec_no, void *buffer)
+{
+  ide_read_multiple (d, sec_no, 1, &buffer);
+}
+
+/* Write sector SEC_NO to disk D from BUFFER, which must contain
+   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
+   acknowledged receiving the data.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_write (void *d, block_sector_t sec_no, const void *buffer)
+{
+  ide_write_multiple (d, sec_no, 1, &buffer);
+}
+
+/* Reads the CNT sectors starting at SEC_NO from disk D into
+   BUFFERS, as block_read_multiple().  Issues one command per
+   MAX_COMMAND_SECTORS sectors, using DMA if D supports it and
+   PIO otherwise.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_read_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                   void *buffers[])
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
+  while (cnt > 0)
+    {
+      size_t command_cnt = (cnt < MAX_COMMAND_SECTORS
+                            ? cnt : MAX_COMMAND_SECTORS);
+
+      if (!dma_transfer (d, sec_no, command_cnt,
+                         (const void **) buffers, true))
+        pio_read (d, sec_no, command_cnt, buffers);
+
+      sec_no += command_cnt;
+      buffers += command_cnt;
+      cnt -= command_cnt;
+    }
   lock_release (&c->lock);
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
+/* Writes the CNT sectors starting at SEC_NO to disk D from
+   BUFFERS, as block_write_multiple().  Returns after the disk has
+   acknowledged receiving all of the data.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+ide_write_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                    const void *buffers[])
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
+  while (cnt > 0)
+    {
+      size_t command_cnt = (cnt < MAX_COMMAND_SECTORS
+                            ? cnt : MAX_COMMAND_SECTORS);
+
+      if (!dma_transfer (d, sec_no, command_cnt, buffers, false))
+        pio_write (d, sec_no, command_cnt, buffers);
+
+      sec_no += command_cnt;
+      buffers += command_cnt;
+      cnt -= command_cnt;
+    }
   lock_release (&c->lock);
 }
 
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multiple,
+    ide_write_multiple,
+    NULL
   };
+
+/* Reads the CNT sectors starting at SEC_NO from disk D into
+   BUFFERS with a single PIO command.  The disk interrupts once
+   per D->multiple_cnt sectors, or once per sector if it does not
+   support READ MULTIPLE.  D's channel lock must be held. */
+static void
+pio_read (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+          void *buffers[])
+{
+  struct channel *c = d->channel;
+  size_t i = 0;
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, (d->multiple_cnt > 1
+                         ? CMD_READ_MULTIPLE : CMD_READ_SECTOR_RETRY));
+  while (i < cnt)
+    {
+      size_t block_cnt = transfer_cnt (d, cnt - i);
+
+      if (!wait_for_interrupt (c))
+        PANIC ("%s: disk read timed out, sector=%"PRDSNu,
+               d->name, sec_no + i);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no + i);
+      for (; block_cnt > 0; block_cnt--, i++)
+        input_sector (c, buffers[i]);
+    }
+}
+
+/* Writes the CNT sectors starting at SEC_NO to disk D from
+   BUFFERS with a single PIO command, as pio_read().  D's channel
+   lock must be held. */
+static void
+pio_write (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+           const void *buffers[])
+{
+  struct channel *c = d->channel;
+  size_t i = 0;
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, (d->multiple_cnt > 1
+                         ? CMD_WRITE_MULTIPLE : CMD_WRITE_SECTOR_RETRY));
+  while (i < cnt)
+    {
+      size_t block_cnt = transfer_cnt (d, cnt - i);
+
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no + i);
+      for (; block_cnt > 0; block_cnt--, i++)
+        output_sector (c, buffers[i]);
+      if (!wait_for_interrupt (c))
+        PANIC ("%s: disk write timed out, sector=%"PRDSNu,
+               d->name, sec_no + i - 1);
+    }
+}
+
+/* Transfers the CNT sectors starting at SEC_NO between disk D
+   and BUFFERS with a single bus-master DMA command, reading from
+   the disk if IS_READ is true and writing to it otherwise.  The
+   CPU is free to run other threads until the disk interrupts at
+   the end of the transfer.  D's channel lock must be held.
+
+   Returns true if successful.  Returns false without touching
+   the disk if D cannot do DMA or if a buffer is unsuitable for
+   it.  If the transfer itself fails, also disables DMA for D and
+   returns false, so that the caller can retry with PIO. */
+static bool
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              const void *buffers[], bool is_read)
+{
+  struct channel *c = d->channel;
+  uint8_t direction = is_read ? BM_CMD_READ : 0;
+  uint8_t bm_status;
+  size_t prd_cnt = 0;
+  size_t i;
+
+  if (!d->use_dma)
+    return false;
+
+  /* Build the PRD table.  Each region must lie within a single
+     64 kB block of physical memory.  Adjacent buffers, which are
+     common because the buffer cache keeps its sectors in
+     contiguous pages, share a region. */
+  for (i = 0; i < cnt; i++)
+    {
+      uint32_t addr, end;
+
+      if (!is_kernel_vaddr (buffers[i]) || ((uintptr_t) buffers[i] & 1))
+        return false;
+      addr = vtop (buffers[i]);
+      end = addr + BLOCK_SECTOR_SIZE;
+      while (addr < end)
+        {
+          struct prd *last = prd_cnt > 0 ? &c->prdt[prd_cnt - 1] : NULL;
+          uint32_t boundary = (addr & ~(uint32_t) 0xffff) + 0x10000;
+          uint32_t size = (end < boundary ? end : boundary) - addr;
+
+          if (last != NULL && last->size != 0
+              && last->addr + last->size == addr && (addr & 0xffff) != 0)
+            last->size += size;
+          else
+            {
+              ASSERT (prd_cnt < PRD_CNT);
+              c->prdt[prd_cnt].addr = addr;
+              c->prdt[prd_cnt].size = size;
+              c->prdt[prd_cnt].flags = 0;
+              prd_cnt++;
+            }
+          addr += size;
+        }
+    }
+  c->prdt[prd_cnt - 1].flags = PRD_EOT;
+
+  /* Program the bus master, start the command, and wait for the
+     completion interrupt. */
+  outl (bm_prdt (c), vtop (c->prdt));
+  outb (bm_command (c), direction);
+  outb (bm_status (c), inb (bm_status (c)) | BM_STA_ERR | BM_STA_INTR);
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, is_read ? CMD_READ_DMA : CMD_WRITE_DMA);
+  outb (bm_command (c), direction | BM_CMD_START);
+  if (!wait_for_interrupt (c))
+    {
+      /* The drive may still be busy with the DMA command, and
+         would ignore a PIO command issued now, so reset the
+         channel before falling back. */
+      outb (bm_command (c), direction);
+      outb (bm_status (c), inb (bm_status (c)) | BM_STA_ERR | BM_STA_INTR);
+      printf ("%s: DMA %s timed out, sector=%"PRDSNu", resetting "
+              "channel and using PIO\n",
+              d->name, is_read ? "read" : "write", sec_no);
+      d->use_dma = false;
+      recover_channel (c);
+      select_device_wait (d);
+      return false;
+    }
+  outb (bm_command (c), direction);
+  bm_status = inb (bm_status (c));
+  outb (bm_status (c), bm_status | BM_STA_ERR | BM_STA_INTR);
+  wait_while_busy (d);
+
+  if ((bm_status & BM_STA_ERR) || (inb (reg_alt_status (c)) & STA_ERR))
+    {
+      printf ("%s: DMA %s failed, sector=%"PRDSNu", using PIO\n",
+              d->name, is_read ? "read" : "write", sec_no);
+      d->use_dma = false;
+      return false;
+    }
+  return true;
+}
 
+/* Returns the number of sectors that disk D transfers between
+   interrupts when CNT sectors of a command remain. */
+static size_t
+transfer_cnt (const struct ata_disk *d, size_t cnt)
+{
+  return cnt < (size_t) d->multiple_cnt ? cnt : (size_t) d->multiple_cnt;
+}
+
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and CNT to the disk's sector selection and count
+   registers.  (We use LBA mode.)  CNT must be between 1 and
+   MAX_COMMAND_SECTORS. */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt >= 1 && cnt <= MAX_COMMAND_SECTORS);
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt % MAX_COMMAND_SECTORS);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -410,6 +843,11 @@ issue_pio_command (struct channel *c, uint8_t command)
      up'd by the completion handler. */
   ASSERT (intr_get_level () == INTR_ON);
 
+  /* Discard any completion left over from a command that timed
+     out, so that it is not mistaken for this command's. */
+  while (sema_try_down (&c->completion_wait))
+    continue;
+
   c->expecting_interrupt = true;
   outb (reg_command (c), command);
 }
@@ -432,6 +870,21 @@ output_sector (struct channel *c, const void *sector)
 
 /* Low-level ATA primitives. */
 
+/* Waits for the completion interrupt of the command in progress
+   on channel C, for up to INTERRUPT_TIMEOUT.  Returns true if the
+   interrupt arrived, false if the wait timed out. */
+static bool
+wait_for_interrupt (struct channel *c)
+{
+  if (sema_down_timeout (&c->completion_wait, INTERRUPT_TIMEOUT))
+    return true;
+
+  printf ("%s: interrupt timeout\n", c->name);
+  c->expecting_interrupt = false;
+  c->timeout_cnt++;
+  return false;
+}
+
 /* Wait up to 10 seconds for the controller to become idle, that
    is, for the BSY and DRQ bits to clear in the status register.
 
@@ -455,13 +908,25 @@ wait_until_idle (const struct ata_disk *d)
 /* Wait up to 30 seconds for disk D to clear BSY,
    and then return the status of the DRQ bit.
    The ATA standards say that a disk may take as long as that to
-   complete its reset. */
+   complete its reset.
+
+   BSY is normally clear already, or about to be, when we get
+   here, so we spin for up to BUSY_SPIN_USECS before falling back
+   to sleeping 10 ms at a time. */
 static bool
 wait_while_busy (const struct ata_disk *d) 
 {
   struct channel *c = d->channel;
   int i;
-  
+
+  for (i = 0; i < BUSY_SPIN_USECS; i++)
+    {
+      if (!(inb (reg_alt_status (c)) & STA_BSY))
+        return (inb (reg_alt_status (c)) & STA_DRQ) != 0;
+      timer_udelay (1);
+    }
+
+  c->slow_wait_cnt++;
   for (i = 0; i < 3000; i++)
     {
       if (i == 700)
@@ -485,21 +950,32 @@ select_device (const struct ata_disk *d)
 {
   struct channel *c = d->channel;
   uint8_t dev = DEV_MBS;
+  int i;
+
   if (d->dev_no == 1)
     dev |= DEV_DEV;
   outb (reg_device (c), dev);
-  inb (reg_alt_status (c));
-  timer_nsleep (400);
+  c->selected = d->dev_no;
+
+  /* The status register is not valid until 400 ns after the
+     device register is written.  Each read of the alternate
+     status register takes at least 100 ns. */
+  for (i = 0; i < 4; i++)
+    inb (reg_alt_status (c));
 }
 
 /* Select disk D in its channel, as select_device(), but wait for
-   the channel to become idle before and after. */
+   the channel to become idle before and after.  If D is already
+   selected, only waits for the channel to become idle. */
 static void
 select_device_wait (const struct ata_disk *d) 
 {
   wait_until_idle (d);
-  select_device (d);
-  wait_until_idle (d);
+  if (d->channel->selected != d->dev_no)
+    {
+      select_device (d);
+      wait_until_idle (d);
+    }
 }
 
 /* ATA interrupt handler. */
@@ -513,6 +989,7 @@ interrupt_handler (struct intr_frame *f)
       {
         if (c->expecting_interrupt) 
           {
+            c->interrupt_cnt++;
             inb (reg_status (c));               /* Acknowledge interrupt. */
             sema_up (&c->completion_wait);      /* Wake up waiter. */
           }
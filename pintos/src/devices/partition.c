@@ -1,5 +1,6 @@
 #include "devices/partition.h"
 #include <packed.h>
+#include <round.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -13,43 +14,112 @@ struct partition
     block_sector_t start;               /* First sector within device. */
   };
 
+/* Number of sectors at the start of a device read in a single
+   request by partition_scan(): the MBR, the GPT header, and
+   enough sectors for the usual 128 GPT entries of 128 bytes.
+   Most devices keep all their partition tables there. */
+#define HEAD_SECTORS 34
+
+/* State of a scan of a block device's partition tables. */
+struct scan
+  {
+    struct block *block;                /* Device being scanned. */
+    uint8_t *head;                      /* First HEAD_CNT sectors. */
+    block_sector_t head_cnt;            /* Number of sectors in HEAD. */
+    int part_nr;                        /* Number of partitions found. */
+  };
+
 static struct block_operations partition_operations;
 
-static void read_partition_table (struct block *, block_sector_t sector,
-                                  block_sector_t primary_extended_sector,
-                                  int *part_nr);
-static void found_partition (struct block *, uint8_t type,
+static void *get_sectors (struct scan *, block_sector_t sector,
+                          size_t cnt, bool *allocated);
+static void read_partition_table (struct scan *, block_sector_t sector,
+                                  block_sector_t primary_extended_sector);
+static bool read_gpt (struct scan *);
+static void found_partition (struct block *, enum block_type,
                              block_sector_t start, block_sector_t size,
-                             int part_nr);
+                             int part_nr, const char *extra_info);
+static enum block_type mbr_block_type (uint8_t);
 static const char *partition_type_name (uint8_t);
 
 /* Scans BLOCK for partitions of interest to Pintos. */
 void
 partition_scan (struct block *block)
 {
-  int part_nr = 0;
-  read_partition_table (block, 0, 0, &part_nr);
-  if (part_nr == 0)
+  struct scan scan;
+  bool allocated;
+
+  scan.block = block;
+  scan.head_cnt = block_size (block);
+  if (scan.head_cnt > HEAD_SECTORS)
+    scan.head_cnt = HEAD_SECTORS;
+  scan.head = NULL;
+  if (scan.head_cnt > 0)
+    scan.head = get_sectors (&scan, 0, scan.head_cnt, &allocated);
+  scan.part_nr = 0;
+
+  read_partition_table (&scan, 0, 0);
+  if (scan.part_nr == 0)
     printf ("%s: Device contains no partitions\n", block_name (block));
+  free (scan.head);
 }
 
-/* Reads the partition table in the given SECTOR of BLOCK and
-   scans it for partitions of interest to Pintos.
+/* Returns the CNT sectors of SCAN's device starting at SECTOR.
+   If they were read by partition_scan() already, returns them
+   from there and sets *ALLOCATED to false.  Otherwise, reads them
+   into newly allocated memory with a single request, and sets
+   *ALLOCATED to true; the caller must then free the memory. */
+static void *
+get_sectors (struct scan *scan, block_sector_t sector, size_t cnt,
+             bool *allocated)
+{
+  uint8_t *data;
+  size_t i;
+
+  if (scan->head != NULL && sector < scan->head_cnt
+      && cnt <= scan->head_cnt - sector)
+    {
+      *allocated = false;
+      return scan->head + sector * BLOCK_SECTOR_SIZE;
+    }
+
+  data = malloc (cnt * BLOCK_SECTOR_SIZE);
+  if (data == NULL)
+    PANIC ("Failed to allocate memory for partition table.");
+  for (i = 0; i < cnt; )
+    {
+      void *buffers[64];
+      size_t batch = cnt - i < 64 ? cnt - i : 64;
+      size_t j;
+
+      for (j = 0; j < batch; j++)
+        buffers[j] = data + (i + j) * BLOCK_SECTOR_SIZE;
+      block_read_multiple (scan->block, sector + i, batch, buffers);
+      i += batch;
+    }
+  *allocated = true;
+  return data;
+}
+
+/* Reads the partition table in the given SECTOR of SCAN's device
+   and scans it for partitions of interest to Pintos.
 
    If SECTOR is 0, so that this is the top-level partition table
-   on BLOCK, then PRIMARY_EXTENDED_SECTOR is not meaningful;
+   on the device, then PRIMARY_EXTENDED_SECTOR is not meaningful;
    otherwise, it should designate the sector of the top-level
    extended partition table that was traversed to arrive at
    SECTOR, for use in finding logical partitions (see the large
    comment below).
 
-   PART_NR points to the number of non-empty primary or logical
-   partitions already encountered on BLOCK.  It is incremented as
-   partitions are found. */
+   If the top-level partition table is a "protective" MBR for a
+   GUID partition table (GPT), the GPT is scanned instead.
+
+   SCAN's PART_NR is the number of non-empty primary or logical
+   partitions already encountered on the device.  It is
+   incremented as partitions are found. */
 static void
-read_partition_table (struct block *block, block_sector_t sector,
-                      block_sector_t primary_extended_sector,
-                      int *part_nr)
+read_partition_table (struct scan *scan, block_sector_t sector,
+                      block_sector_t primary_extended_sector)
 {
   /* Format of a partition table entry.  See [Partitions]. */
   struct partition_table_entry
@@ -72,7 +142,9 @@ read_partition_table (struct block *block, block_sector_t sector,
     }
   PACKED;
 
+  struct block *block = scan->block;
   struct partition_table *pt;
+  bool allocated;
   size_t i;
 
   /* Check SECTOR validity. */
@@ -85,10 +157,7 @@ read_partition_table (struct block *block, block_sector_t sector,
 
   /* Read sector. */
   ASSERT (sizeof *pt == BLOCK_SECTOR_SIZE);
-  pt = malloc (sizeof *pt);
-  if (pt == NULL)
-    PANIC ("Failed to allocate memory for partition table.");
-  block_read (block, 0, pt);
+  pt = get_sectors (scan, sector, 1, &allocated);
 
   /* Check signature. */
   if (pt->signature != 0xaa55)
@@ -98,10 +167,21 @@ read_partition_table (struct block *block, block_sector_t sector,
       else
         printf ("%s: Invalid extended partition table in sector %"PRDSNu"\n",
                 block_name (block), sector);
-      free (pt);
+      if (allocated)
+        free (pt);
       return;
     }
 
+  /* Scan the GPT instead, if this is a protective MBR. */
+  if (sector == 0)
+    for (i = 0; i < sizeof pt->partitions / sizeof *pt->partitions; i++)
+      if (pt->partitions[i].type == 0xee && read_gpt (scan))
+        {
+          if (allocated)
+            free (pt);
+          return;
+        }
+
   /* Parse partitions. */
   for (i = 0; i < sizeof pt->partitions / sizeof *pt->partitions; i++)
     {
@@ -128,32 +208,254 @@ read_partition_table (struct block *block, block_sector_t sector,
              is nested, the offset is relative to the start of
              the extended partition that the MBR points to. */
           if (sector == 0)
-            read_partition_table (block, e->offset, e->offset, part_nr);
+            read_partition_table (scan, e->offset, e->offset);
           else
-            read_partition_table (block, e->offset + primary_extended_sector,
-                                  primary_extended_sector, part_nr);
+            read_partition_table (scan, e->offset + primary_extended_sector,
+                                  primary_extended_sector);
         }
       else
         {
-          ++*part_nr;
+          char extra_info[128];
 
-          found_partition (block, e->type, e->offset + sector,
-                           e->size, *part_nr);
+          ++scan->part_nr;
+          snprintf (extra_info, sizeof extra_info, "%s (%02x)",
+                    partition_type_name (e->type), e->type);
+          found_partition (block, mbr_block_type (e->type),
+                           e->offset + sector, e->size, scan->part_nr,
+                           extra_info);
         }
     }
 
-  free (pt);
+  if (allocated)
+    free (pt);
+}
+
+/* GUID partition table header.  See [UEFI] section 5.3. */
+struct gpt_header
+  {
+    char signature[8];          /* "EFI PART". */
+    uint32_t revision;          /* 0x00010000 for version 1.0. */
+    uint32_t header_size;       /* Bytes covered by HEADER_CRC. */
+    uint32_t header_crc;        /* CRC32 of header, with this field 0. */
+    uint32_t reserved;
+    uint64_t my_lba;            /* Sector holding this header. */
+    uint64_t alternate_lba;     /* Sector holding the other copy. */
+    uint64_t first_usable_lba;  /* First sector usable by partitions. */
+    uint64_t last_usable_lba;   /* Last sector usable by partitions. */
+    uint8_t disk_guid[16];      /* Identifies the disk. */
+    uint64_t entries_lba;       /* First sector of entry array. */
+    uint32_t entry_cnt;         /* Number of entries. */
+    uint32_t entry_size;        /* Bytes per entry, a multiple of 128. */
+    uint32_t entries_crc;       /* CRC32 of entry array. */
+  }
+PACKED;
+
+/* GUID partition table entry. */
+struct gpt_entry
+  {
+    uint8_t type[16];           /* Partition type GUID, or all zeros. */
+    uint8_t unique[16];         /* Identifies the partition. */
+    uint64_t first_lba;         /* First sector. */
+    uint64_t last_lba;          /* Last sector, inclusive. */
+    uint64_t attributes;
+    uint16_t name[36];          /* Name, in UTF-16LE. */
+  }
+PACKED;
+
+/* Largest GPT entry array we are willing to read, in bytes. */
+#define GPT_MAX_ENTRIES_SIZE (1024 * 1024)
+
+/* GPT partition types that we know by name.  There are no
+   registered type GUIDs for Pintos, so we made up our own. */
+static const struct gpt_type
+  {
+    const char *guid;           /* Type GUID, in lowercase. */
+    const char *name;           /* Human-readable name. */
+    enum block_type type;       /* Role in Pintos. */
+  }
+gpt_types[] =
+  {
+    {"e8c1a8b0-5049-4e54-4f53-000000000020", "Pintos OS kernel",
+     BLOCK_KERNEL},
+    {"e8c1a8b0-5049-4e54-4f53-000000000021", "Pintos file system",
+     BLOCK_FILESYS},
+    {"e8c1a8b0-5049-4e54-4f53-000000000022", "Pintos scratch",
+     BLOCK_SCRATCH},
+    {"e8c1a8b0-5049-4e54-4f53-000000000023", "Pintos swap", BLOCK_SWAP},
+    {"c12a7328-f81f-11d2-ba4b-00a0c93ec93b", "EFI System", BLOCK_FOREIGN},
+    {"21686148-6449-6e6f-744e-656564454649", "BIOS boot", BLOCK_FOREIGN},
+    {"ebd0a0a2-b9e5-4433-87c0-68b6b72699c7", "Microsoft basic data",
+     BLOCK_FOREIGN},
+    {"0fc63daf-8483-4772-8e79-3d69d8477de4", "Linux filesystem",
+     BLOCK_FOREIGN},
+    {"0657fd6d-a4ab-43c4-84e5-0933c84b4f4f", "Linux swap", BLOCK_FOREIGN},
+    {"e6d6d379-f507-44c2-a23c-238f2a3df928", "Linux LVM", BLOCK_FOREIGN},
+    {"a19d880f-05fc-4d3b-a006-743f0f84911e", "Linux RAID", BLOCK_FOREIGN},
+    {"516e7cb4-6ecf-11d6-8ff8-00022d09712b", "FreeBSD", BLOCK_FOREIGN},
+    {"48465300-0000-11aa-aa11-00306543ecac", "Apple HFS+", BLOCK_FOREIGN},
+  };
+#define GPT_TYPE_CNT (sizeof gpt_types / sizeof *gpt_types)
+
+/* Returns the CRC32 of the SIZE bytes in BUF, as used by GPT. */
+static uint32_t
+gpt_crc32 (const void *buf, size_t size)
+{
+  const uint8_t *p = buf;
+  uint32_t crc = 0xffffffff;
+
+  while (size-- > 0)
+    {
+      int i;
+
+      crc ^= *p++;
+      for (i = 0; i < 8; i++)
+        crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+  return ~crc;
+}
+
+/* Formats the GUID in the 16 bytes at GUID, which are stored in
+   the mixed-endian GPT format, into the 37-byte buffer S. */
+static void
+format_guid (const uint8_t guid[16], char s[37])
+{
+  snprintf (s, 37, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-"
+            "%02x%02x%02x%02x%02x%02x",
+            guid[3], guid[2], guid[1], guid[0], guid[5], guid[4],
+            guid[7], guid[6], guid[8], guid[9], guid[10], guid[11],
+            guid[12], guid[13], guid[14], guid[15]);
+}
+
+/* Reads the GPT header in SECTOR of SCAN's device into HEADER
+   and checks it.  Returns true if it is valid, false
+   otherwise. */
+static bool
+read_gpt_header (struct scan *scan, block_sector_t sector,
+                 struct gpt_header *header)
+{
+  uint8_t *data;
+  bool allocated;
+  bool ok;
+
+  if (sector >= block_size (scan->block))
+    return false;
+  data = get_sectors (scan, sector, 1, &allocated);
+  memcpy (header, data, sizeof *header);
+  ok = (!memcmp (header->signature, "EFI PART", 8)
+        && header->header_size >= sizeof *header
+        && header->header_size <= BLOCK_SECTOR_SIZE
+        && header->my_lba == sector);
+  if (ok)
+    {
+      /* The CRC covers the header with the CRC field zeroed. */
+      struct gpt_header *h = (struct gpt_header *) data;
+      uint32_t crc = h->header_crc;
+      h->header_crc = 0;
+      ok = gpt_crc32 (data, header->header_size) == crc;
+      h->header_crc = crc;
+    }
+  ok = (ok
+        && header->entry_size >= sizeof (struct gpt_entry)
+        && header->entry_size % 8 == 0
+        && header->entry_cnt <= GPT_MAX_ENTRIES_SIZE / header->entry_size
+        && header->entries_lba < block_size (scan->block));
+  if (allocated)
+    free (data);
+  return ok;
+}
+
+/* Scans the GUID partition table on SCAN's device for partitions
+   of interest to Pintos.  Uses the backup copy in the device's
+   last sector if the primary copy is damaged.  Returns true if a
+   valid GPT was found, false otherwise. */
+static bool
+read_gpt (struct scan *scan)
+{
+  struct block *block = scan->block;
+  struct gpt_header header;
+  size_t size, sector_cnt, i;
+  uint8_t *entries;
+  bool allocated;
+
+  if (!read_gpt_header (scan, 1, &header))
+    {
+      printf ("%s: Invalid primary GPT, trying backup\n", block_name (block));
+      if (!read_gpt_header (scan, block_size (block) - 1, &header))
+        {
+          printf ("%s: Invalid backup GPT\n", block_name (block));
+          return false;
+        }
+    }
+
+  if (header.entry_cnt == 0)
+    return true;
+
+  /* Read the whole entry array with one request. */
+  size = header.entry_cnt * header.entry_size;
+  sector_cnt = DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
+  if (sector_cnt > block_size (block) - header.entries_lba)
+    {
+      printf ("%s: GPT entries past end of device\n", block_name (block));
+      return false;
+    }
+  entries = get_sectors (scan, header.entries_lba, sector_cnt, &allocated);
+  if (gpt_crc32 (entries, size) != header.entries_crc)
+    {
+      printf ("%s: GPT entry array is corrupt\n", block_name (block));
+      if (allocated)
+        free (entries);
+      return false;
+    }
+
+  for (i = 0; i < header.entry_cnt; i++)
+    {
+      const struct gpt_entry *e
+        = (const struct gpt_entry *) (entries + i * header.entry_size);
+      static const uint8_t unused[16];
+      const struct gpt_type *t;
+      char guid[37];
+      char extra_info[128];
+
+      if (!memcmp (e->type, unused, sizeof unused))
+        continue;
+      scan->part_nr = i + 1;
+      if (e->first_lba > e->last_lba
+          || e->last_lba >= block_size (block))
+        {
+          printf ("%s%zu: Partition past end of device\n",
+                  block_name (block), i + 1);
+          continue;
+        }
+
+      format_guid (e->type, guid);
+      for (t = gpt_types; t < gpt_types + GPT_TYPE_CNT; t++)
+        if (!strcmp (guid, t->guid))
+          break;
+      if (t < gpt_types + GPT_TYPE_CNT)
+        snprintf (extra_info, sizeof extra_info, "%s (GPT)", t->name);
+      else
+        snprintf (extra_info, sizeof extra_info, "Unknown (GPT %s)", guid);
+      found_partition (block,
+                       t < gpt_types + GPT_TYPE_CNT ? t->type : BLOCK_FOREIGN,
+                       e->first_lba, e->last_lba - e->first_lba + 1, i + 1,
+                       extra_info);
+    }
+
+  if (allocated)
+    free (entries);
+  return true;
 }
 
 /* We have found a primary or logical partition of the given TYPE
    on BLOCK, starting at sector START and continuing for SIZE
    sectors, which we are giving the partition number PART_NR.
    Check whether this is a partition of interest to Pintos, and
-   if so then add it to the proper element of partitions[]. */
+   if so then register it as a block device, printing EXTRA_INFO
+   to describe it. */
 static void
-found_partition (struct block *block, uint8_t part_type,
+found_partition (struct block *block, enum block_type type,
                  block_sector_t start, block_sector_t size,
-                 int part_nr)
+                 int part_nr, const char *extra_info)
 {
   if (start >= block_size (block))
     printf ("%s%d: Partition starts past end of device (sector %"PRDSNu")\n",
@@ -163,13 +465,7 @@ found_partition (struct block *block, uint8_t part_type,
             block_name (block), part_nr, start + size, block_size (block));
   else
     {
-      enum block_type type = (part_type == 0x20 ? BLOCK_KERNEL
-                              : part_type == 0x21 ? BLOCK_FILESYS
-                              : part_type == 0x22 ? BLOCK_SCRATCH
-                              : part_type == 0x23 ? BLOCK_SWAP
-                              : BLOCK_FOREIGN);
       struct partition *p;
-      char extra_info[128];
       char name[16];
 
       p = malloc (sizeof *p);
@@ -179,12 +475,23 @@ found_partition (struct block *block, uint8_t part_type,
       p->start = start;
 
       snprintf (name, sizeof name, "%s%d", block_name (block), part_nr);
-      snprintf (extra_info, sizeof extra_info, "%s (%02x)",
-                partition_type_name (part_type), part_type);
-      block_register (name, type, extra_info, size, &partition_operations, p);
+      block_register (name, type, extra_info, size, &partition_operations, p,
+                      NULL);
     }
 }
 
+/* Returns the Pintos role, if any, of an MBR partition of the
+   given PART_TYPE. */
+static enum block_type
+mbr_block_type (uint8_t part_type)
+{
+  return (part_type == 0x20 ? BLOCK_KERNEL
+          : part_type == 0x21 ? BLOCK_FILESYS
+          : part_type == 0x22 ? BLOCK_SCRATCH
+          : part_type == 0x23 ? BLOCK_SWAP
+          : BLOCK_FOREIGN);
+}
+
 /* Returns a human-readable name for the given partition TYPE. */
 static const char *
 partition_type_name (uint8_t type)
@@ -298,27 +605,23 @@ partition_type_name (uint8_t type)
   return type_names[type] != NULL ? type_names[type] : "Unknown";
 }
 
-/* Reads sector SECTOR from partition P into BUFFER, which must
-   have room for BLOCK_SECTOR_SIZE bytes. */
-static void
-partition_read (void *p_, block_sector_t sector, void *buffer)
-{
-  struct partition *p = p_;
-  block_read (p->block, p->start + sector, buffer);
-}
-
-/* Write sector SECTOR to partition P from BUFFER, which must
-   contain BLOCK_SECTOR_SIZE bytes.  Returns after the block has
-   acknowledged receiving the data. */
-static void
-partition_write (void *p_, block_sector_t sector, const void *buffer)
+/* Translates *SECTOR within partition P into the corresponding
+   sector of the underlying block device, which it returns.
+   Requests for a partition are thereby queued, scheduled, and
+   merged along with all the others for its device. */
+static struct block *
+partition_remap (void *p_, block_sector_t *sector)
 {
   struct partition *p = p_;
-  block_write (p->block, p->start + sector, buffer);
+  *sector += p->start;
+  return p->block;
 }
 
 static struct block_operations partition_operations =
   {
-    partition_read,
-    partition_write
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    partition_remap
   };
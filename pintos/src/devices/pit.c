@@ -11,9 +11,6 @@
 #define PIT_PORT_CONTROL          0x43                /* Control port. */
 #define PIT_PORT_COUNTER(CHANNEL) (0x40 + (CHANNEL))  /* Counter port. */
 
-/* PIT cycles per second. */
-#define PIT_HZ 1193180
-
 /* Configure the given CHANNEL in the PIT.  In a PC, the PIT's
    three output channels are hooked up like this:
 
@@ -81,3 +78,23 @@ pit_configure_channel (int channel, int mode, int frequency)
   outb (PIT_PORT_COUNTER (channel), count >> 8);
   intr_set_level (old_level);
 }
+
+/* Returns the current value of the counter of the given CHANNEL
+   in the PIT, which counts down once per PIT cycle from the
+   count set by pit_configure_channel() and then starts over. */
+unsigned
+pit_read_counter (int channel)
+{
+  unsigned count;
+  enum intr_level old_level;
+
+  ASSERT (channel == 0 || channel == 2);
+
+  /* Latch the counter, then read it low byte first. */
+  old_level = intr_disable ();
+  outb (PIT_PORT_CONTROL, channel << 6);
+  count = inb (PIT_PORT_COUNTER (channel));
+  count |= inb (PIT_PORT_COUNTER (channel)) << 8;
+  intr_set_level (old_level);
+  return count;
+}
@@ -0,0 +1,147 @@
+#include "devices/ramdisk.h"
+#include <debug.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/block.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* A RAM disk, a block device whose sectors are kept in memory.
+
+   A RAM disk is useful for benchmarking code above the block
+   layer, such as the buffer cache and the file system, without
+   the cost of emulated disk hardware, and as a fast scratch
+   device.  Its contents are lost at shutdown.
+
+   The disk's sectors are stored in kernel pages, which need not
+   be contiguous, so a RAM disk can be nearly as large as the
+   kernel pool.  HEADROOM_PAGES are always left for the rest of
+   the kernel, such as the buffer cache, which is set up later. */
+
+/* Number of sectors in a page. */
+#define SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* Number of kernel pages that a RAM disk must leave free. */
+#define HEADROOM_PAGES 256
+
+/* A RAM disk. */
+struct ramdisk
+  {
+    uint8_t **pages;            /* Pages holding the sectors. */
+    size_t page_cnt;            /* Number of pages. */
+  };
+
+static struct block_operations ramdisk_operations;
+
+/* Creates a RAM disk named "ram0" of SIZE bytes, rounded down to
+   a whole number of pages, and registers it with the block
+   layer.  If that would leave fewer than HEADROOM_PAGES kernel
+   pages free, no disk is created.  The disk starts out zeroed.
+
+   The RAM disk has type BLOCK_RAW, so it is never chosen for a
+   role by default.  Select it by name, e.g. with -filesys=ram0
+   or -scratch=ram0. */
+void
+ramdisk_init (size_t size)
+{
+  struct ramdisk *rd;
+  size_t page_cnt = size / PGSIZE;
+  void *headroom = NULL;
+  size_t i;
+
+  if (page_cnt == 0)
+    return;
+
+  rd = malloc (sizeof *rd);
+  if (rd != NULL)
+    {
+      rd->pages = calloc (page_cnt, sizeof *rd->pages);
+      if (rd->pages == NULL)
+        {
+          free (rd);
+          rd = NULL;
+        }
+    }
+
+  /* Set aside the headroom first, chaining its pages together
+     through their first words, so that the disk cannot take
+     it. */
+  for (i = 0; rd != NULL && i < HEADROOM_PAGES; i++)
+    {
+      void **page = palloc_get_page (0);
+      if (page == NULL)
+        break;
+      *page = headroom;
+      headroom = page;
+    }
+
+  if (rd != NULL)
+    {
+      rd->page_cnt = 0;
+      if (i == HEADROOM_PAGES)
+        for (; rd->page_cnt < page_cnt; rd->page_cnt++)
+          {
+            rd->pages[rd->page_cnt] = palloc_get_page (PAL_ZERO);
+            if (rd->pages[rd->page_cnt] == NULL)
+              break;
+          }
+    }
+
+  while (headroom != NULL)
+    {
+      void *next = *(void **) headroom;
+      palloc_free_page (headroom);
+      headroom = next;
+    }
+
+  if (rd == NULL || rd->page_cnt < page_cnt)
+    {
+      printf ("ram0: not enough memory for a %zu kB RAM disk\n",
+              page_cnt * PGSIZE / 1024);
+      if (rd != NULL)
+        {
+          for (i = 0; i < rd->page_cnt; i++)
+            palloc_free_page (rd->pages[i]);
+          free (rd->pages);
+          free (rd);
+        }
+      return;
+    }
+
+  block_register ("ram0", BLOCK_RAW, "RAM disk",
+                  rd->page_cnt * SECTORS_PER_PAGE, &ramdisk_operations,
+                  rd, NULL);
+}
+
+/* Returns the address of sector SECTOR in RD. */
+static uint8_t *
+sector_address (struct ramdisk *rd, block_sector_t sector)
+{
+  ASSERT (sector / SECTORS_PER_PAGE < rd->page_cnt);
+  return (rd->pages[sector / SECTORS_PER_PAGE]
+          + sector % SECTORS_PER_PAGE * BLOCK_SECTOR_SIZE);
+}
+
+/* Reads sector SECTOR from RAM disk RD_ into BUFFER. */
+static void
+ramdisk_read (void *rd_, block_sector_t sector, void *buffer)
+{
+  memcpy (buffer, sector_address (rd_, sector), BLOCK_SECTOR_SIZE);
+}
+
+/* Writes sector SECTOR to RAM disk RD_ from BUFFER. */
+static void
+ramdisk_write (void *rd_, block_sector_t sector, const void *buffer)
+{
+  memcpy (sector_address (rd_, sector), buffer, BLOCK_SECTOR_SIZE);
+}
+
+static struct block_operations ramdisk_operations =
+  {
+    ramdisk_read,
+    ramdisk_write,
+    NULL,
+    NULL,
+    NULL
+  };
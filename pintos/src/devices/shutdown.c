@@ -1,16 +1,22 @@
 #include "devices/shutdown.h"
 #include <console.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include "devices/kbd.h"
 #include "devices/serial.h"
 #include "devices/timer.h"
 #include "threads/io.h"
+#include "threads/memtrack.h"
+#include "threads/palloc.h"
 #include "threads/thread.h"
 #ifdef USERPROG
 #include "userprog/exception.h"
 #endif
 #ifdef FILESYS
 #include "devices/block.h"
+#include "devices/ide.h"
+#include "filesys/cache.h"
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
 #endif
 
@@ -20,6 +26,9 @@
 /* How to shut down when shutdown() is called. */
 static enum shutdown_type how = SHUTDOWN_NONE;
 
+/* True if shutting down because of a kernel panic. */
+static bool panicking;
+
 static void print_stats (void);
 
 /* Shuts down the machine in the way configured by
@@ -44,6 +53,16 @@ shutdown (void)
     }
 }
 
+/* Shuts down like shutdown(), but for a kernel panic: the file
+   system may be in any state and its locks may be held, so
+   nothing is written to disk. */
+void
+shutdown_panic (void)
+{
+  panicking = true;
+  shutdown ();
+}
+
 /* Sets TYPE as the way that machine will shut down when Pintos
    execution is complete. */
 void
@@ -91,7 +110,14 @@ shutdown_power_off (void)
   const char *p;
 
 #ifdef FILESYS
-  filesys_done ();
+  /* After a panic, skip anything that does disk I/O.  The panic
+     may have happened on a block channel's dispatcher thread, in
+     which case no request on that channel would ever complete. */
+  if (!panicking)
+    {
+      filesys_done ();
+      block_trace_save ();
+    }
 #endif
 
   print_stats ();
@@ -122,10 +148,17 @@ print_stats (void)
   thread_print_stats ();
 #ifdef FILESYS
   block_print_stats ();
+  ide_print_stats ();
+  cache_print_stats ();
+  dcache_print_stats ();
 #endif
   console_print_stats ();
   kbd_print_stats ();
 #ifdef USERPROG
   exception_print_stats ();
+#endif
+  palloc_print_stats ();
+#ifdef MEMTRACK
+  memtrack_print_stats ();
 #endif
 }
@@ -19,6 +19,9 @@
 
 static struct list wait_list;
 
+/* Pending alarms, soonest first. */
+static struct list alarm_list;
+
 /* Number of timer ticks since OS booted. */
 static int64_t ticks;
 
@@ -40,6 +43,7 @@ timer_init (void)
   pit_configure_channel (0, 2, TIMER_FREQ);
   intr_register_ext (0x20, timer_interrupt, "8254 Timer");
   list_init(&wait_list);
+  list_init (&alarm_list);
 }
 
 /* Calibrates loops_per_tick, used to implement brief delays. */
@@ -87,6 +91,29 @@ timer_elapsed (int64_t then)
   return timer_ticks () - then;
 }
 
+/* Returns the number of microseconds since the OS booted.  This
+   is finer grained than timer_ticks(), because the time within
+   the current tick is read from the PIT's counter. */
+int64_t
+timer_usecs (void)
+{
+  static int64_t last;
+  const unsigned period = (PIT_HZ + TIMER_FREQ / 2) / TIMER_FREQ;
+  enum intr_level old_level = intr_disable ();
+  unsigned count = pit_read_counter (0);
+  int64_t cycles = ticks * period + (period - count);
+  int64_t usecs = cycles * 1000000 / PIT_HZ;
+
+  /* If the counter started over while interrupts were off, the
+     tick that it finished has not been counted yet, so USECS may
+     be earlier than a time already returned.  Never go back. */
+  if (usecs < last)
+    usecs = last;
+  last = usecs;
+  intr_set_level (old_level);
+  return usecs;
+}
+
 // Added function to check wakeup time between threads (Jim)
 bool compare_threads_by_wakeup_time ( const struct list_elem *a_, const struct list_elem *b_, void *aux ) {
   const struct thread *a = list_entry (a_, struct thread, timer_list_elem);
@@ -142,6 +169,48 @@ timer_nsleep (int64_t ns)
   real_time_sleep (ns, 1000 * 1000 * 1000);
 }
 
+/* Returns true if alarm A fires before alarm B. */
+static bool
+alarm_less (const struct list_elem *a_, const struct list_elem *b_,
+            void *aux UNUSED)
+{
+  const struct timer_alarm *a = list_entry (a_, struct timer_alarm, elem);
+  const struct timer_alarm *b = list_entry (b_, struct timer_alarm, elem);
+  return a->when < b->when;
+}
+
+/* Sets ALARM to call FUNC with AUX from the timer interrupt
+   handler in approximately TICKS timer ticks.  ALARM must not
+   already be pending. */
+void
+timer_alarm_set (struct timer_alarm *alarm, int64_t ticks,
+                 void (*func) (void *aux), void *aux)
+{
+  enum intr_level old_level = intr_disable ();
+
+  alarm->when = timer_ticks () + ticks;
+  alarm->func = func;
+  alarm->aux = aux;
+  alarm->pending = true;
+  list_insert_ordered (&alarm_list, &alarm->elem, alarm_less, NULL);
+  intr_set_level (old_level);
+}
+
+/* Cancels ALARM if it has not fired yet.  Does nothing if it
+   has. */
+void
+timer_alarm_cancel (struct timer_alarm *alarm)
+{
+  enum intr_level old_level = intr_disable ();
+
+  if (alarm->pending)
+    {
+      list_remove (&alarm->elem);
+      alarm->pending = false;
+    }
+  intr_set_level (old_level);
+}
+
 /* Busy-waits for approximately MS milliseconds.  Interrupts need
    not be turned on.
 
@@ -203,6 +272,19 @@ timer_interrupt (struct intr_frame *args UNUSED)
   }
 
   ticks++;
+
+  /* Fire due alarms. */
+  while (!list_empty (&alarm_list))
+    {
+      struct timer_alarm *alarm = list_entry (list_front (&alarm_list),
+                                              struct timer_alarm, elem);
+      if (alarm->when > ticks)
+        break;
+      list_pop_front (&alarm_list);
+      alarm->pending = false;
+      alarm->func (alarm->aux);
+    }
+
   thread_tick ();
 }
 
@@ -1,7 +1,9 @@
 #ifndef DEVICES_TIMER_H
 #define DEVICES_TIMER_H
 
+#include <list.h>
 #include <round.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 /* Number of timer interrupts per second. */
@@ -12,6 +14,7 @@ void timer_calibrate (void);
 
 int64_t timer_ticks (void);
 int64_t timer_elapsed (int64_t);
+int64_t timer_usecs (void);
 
 /* Sleep and yield the CPU to other threads. */
 void timer_sleep (int64_t ticks);
@@ -19,6 +22,22 @@ void timer_msleep (int64_t milliseconds);
 void timer_usleep (int64_t microseconds);
 void timer_nsleep (int64_t nanoseconds);
 
+/* A one-shot alarm, which calls FUNC with AUX from the timer
+   interrupt handler once a given tick arrives.  FUNC runs in an
+   interrupt context, so it must not sleep. */
+struct timer_alarm
+  {
+    struct list_elem elem;              /* Element in alarm list. */
+    int64_t when;                       /* Tick at which to fire. */
+    void (*func) (void *aux);           /* Function to call. */
+    void *aux;                          /* Argument for FUNC. */
+    bool pending;                       /* Set and not yet fired? */
+  };
+
+void timer_alarm_set (struct timer_alarm *, int64_t ticks,
+                      void (*func) (void *aux), void *aux);
+void timer_alarm_cancel (struct timer_alarm *);
+
 /* Busy waits. */
 void timer_mdelay (int64_t milliseconds);
 void timer_udelay (int64_t microseconds);
@@ -0,0 +1,659 @@
+#include "filesys/cache.h"
+#include <crc32c.h>
+#include <debug.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/filesys.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Buffer cache.
+
+   Keeps the CACHE_CNT most recently used sectors of the file
+   system device in memory.  Every file system access to the
+   device goes through cache_read() and cache_write().
+
+   The mapping from sectors to entries, the clock hand, and each
+   entry's pin count are protected by cache_lock.  The contents
+   of an entry are protected by the entry's own lock, so that
+   threads working on different sectors need not wait for each
+   other's disk I/O.  An entry with a nonzero pin count is in use
+   and will not be evicted.
+
+   Replacement uses the clock (second chance) algorithm.
+
+   The cache is write-behind: cache_write() only marks the entry
+   dirty, so that repeated writes to a sector cost a single disk
+   write.  Dirty entries are written back when they are evicted
+   and whenever cache_flush() is called, which the file system
+   does periodically and at shutdown.  A flush writes dirty
+   sectors in order and writes each run of consecutive sectors
+   with a single multi-sector request.
+
+   Sectors that the file system expects to need soon can be
+   handed to cache_readahead(), which queues them for a worker
+   thread that reads them in the background, again a run of
+   consecutive sectors at a time.  The cache keeps
+   track of how many prefetched sectors are used before they are
+   evicted and adjusts cache_readahead_limit() to match.
+
+   File system metadata is accessed with cache_read_meta() and
+   cache_write_meta() instead.  If FS_CHECKSUM is defined, the
+   last 4 bytes of a metadata sector hold the CRC32C of the
+   first META_SECTOR_SIZE bytes.  The checksum is computed only
+   when the sector is written back, and checked only the first
+   time a metadata access finds the sector freshly read from
+   disk, so each costs one pass over the sector per disk
+   transfer.  Whether a sector is metadata is decided by the last
+   write to it, because a freed sector may be reused for
+   something else. */
+
+/* Number of sectors in the cache. */
+#define CACHE_CNT 64
+
+/* Sector number of an entry that holds no sector. */
+#define NO_SECTOR ((block_sector_t) -1)
+
+/* A cached sector. */
+struct cache_entry
+  {
+    block_sector_t sector;              /* Sector held, or NO_SECTOR. */
+    bool accessed;                      /* Used since the hand passed? */
+    bool dirty;                         /* Differs from disk?  Protected
+                                           by LOCK. */
+    bool prefetched;                    /* Read ahead, not yet used? */
+    bool meta;                          /* Metadata, by the last write?
+                                           Protected by LOCK. */
+    bool verified;                      /* DATA not read from disk since
+                                           it was last checked or
+                                           written?  Protected by LOCK. */
+    int pin_cnt;                        /* Number of threads using it. */
+    struct lock lock;                   /* Protects DATA. */
+    uint8_t *data;                      /* BLOCK_SECTOR_SIZE bytes. */
+  };
+
+static struct cache_entry cache[CACHE_CNT];
+static struct lock cache_lock;          /* Protects the mapping. */
+static struct condition cache_unpinned; /* Signaled when a pin drops. */
+static size_t clock_hand;               /* Next eviction candidate. */
+
+/* Read-ahead.
+   The queue is a ring buffer protected by readahead_lock.
+   The remaining variables are protected by cache_lock. */
+#define READAHEAD_QUEUE 32              /* Max queued sectors. */
+#define READAHEAD_MAX 32                /* Max sectors to read ahead. */
+#define READAHEAD_EPOCH 32              /* Outcomes between adjustments. */
+#define READAHEAD_RUN 16                /* Max sectors read at once. */
+static block_sector_t readahead_queue[READAHEAD_QUEUE];
+static size_t readahead_head, readahead_tail;
+static struct lock readahead_lock;
+static struct condition readahead_ready;
+static size_t readahead_limit = 4;      /* Current read-ahead window. */
+static int epoch_hit_cnt, epoch_waste_cnt; /* Outcomes this epoch. */
+
+/* Statistics. */
+static long long hit_cnt, miss_cnt, evict_cnt;
+static long long write_cnt, writeback_cnt;
+static long long readahead_cnt, readahead_hit_cnt, readahead_waste_cnt;
+#ifdef FS_CHECKSUM
+static long long seal_cnt, verify_cnt;
+#endif
+
+static struct cache_entry *cache_get (block_sector_t, bool load,
+                                      bool prefetch);
+static void readahead_outcome (bool used);
+static thread_func readahead_daemon NO_RETURN;
+static void cache_put (struct cache_entry *);
+static void unpin (struct cache_entry *);
+static void write_back (struct cache_entry *[], size_t cnt);
+static void read_run (struct cache_entry *[], size_t cnt);
+static void read_sector (block_sector_t, void *, size_t ofs, size_t size,
+                         bool meta);
+static void write_sector (block_sector_t, const void *, size_t ofs,
+                          size_t size, bool meta);
+static void verify (struct cache_entry *);
+static void seal (struct cache_entry *);
+
+/* Initializes the buffer cache. */
+void
+cache_init (void)
+{
+  size_t page_cnt = CACHE_CNT * BLOCK_SECTOR_SIZE / PGSIZE;
+  uint8_t *data = palloc_get_multiple (PAL_ASSERT, page_cnt);
+  size_t i;
+
+  lock_init (&cache_lock);
+  cond_init (&cache_unpinned);
+  for (i = 0; i < CACHE_CNT; i++)
+    {
+      struct cache_entry *e = &cache[i];
+      e->sector = NO_SECTOR;
+      e->accessed = false;
+      e->dirty = false;
+      e->prefetched = false;
+      e->meta = false;
+      e->verified = true;
+      e->pin_cnt = 0;
+      lock_init (&e->lock);
+      e->data = data + i * BLOCK_SECTOR_SIZE;
+    }
+
+  lock_init (&readahead_lock);
+  cond_init (&readahead_ready);
+  thread_create ("readahead", PRI_DEFAULT, readahead_daemon, NULL);
+}
+
+/* Reads SIZE bytes starting at byte offset OFS within SECTOR of
+   the file system device into BUFFER. */
+void
+cache_read (block_sector_t sector, void *buffer, size_t ofs, size_t size)
+{
+  read_sector (sector, buffer, ofs, size, false);
+}
+
+/* Writes SIZE bytes from BUFFER into SECTOR of the file system
+   device, starting at byte offset OFS within the sector.  The
+   data reaches the device later, when the sector is evicted or
+   flushed. */
+void
+cache_write (block_sector_t sector, const void *buffer, size_t ofs,
+             size_t size)
+{
+  write_sector (sector, buffer, ofs, size, false);
+}
+
+/* Reads SIZE bytes starting at byte offset OFS within metadata
+   sector SECTOR into BUFFER, as cache_read(), first checking the
+   sector's checksum if FS_CHECKSUM is defined.  OFS + SIZE must
+   not exceed META_SECTOR_SIZE. */
+void
+cache_read_meta (block_sector_t sector, void *buffer, size_t ofs,
+                 size_t size)
+{
+  read_sector (sector, buffer, ofs, size, true);
+}
+
+/* Writes SIZE bytes from BUFFER into metadata sector SECTOR,
+   starting at byte offset OFS, as cache_write().  The sector's
+   checksum is updated when it is written back.  OFS + SIZE must
+   not exceed META_SECTOR_SIZE. */
+void
+cache_write_meta (block_sector_t sector, const void *buffer, size_t ofs,
+                  size_t size)
+{
+  write_sector (sector, buffer, ofs, size, true);
+}
+
+/* Reads SIZE bytes at offset OFS in SECTOR into BUFFER.  META
+   says whether SECTOR is a metadata sector. */
+static void
+read_sector (block_sector_t sector, void *buffer, size_t ofs, size_t size,
+             bool meta)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs + size <= (meta ? META_SECTOR_SIZE : BLOCK_SECTOR_SIZE));
+
+  e = cache_get (sector, true, false);
+  if (meta)
+    verify (e);
+  memcpy (buffer, e->data + ofs, size);
+  cache_put (e);
+}
+
+/* Writes SIZE bytes from BUFFER into SECTOR at offset OFS.  META
+   says whether SECTOR is a metadata sector. */
+static void
+write_sector (block_sector_t sector, const void *buffer, size_t ofs,
+              size_t size, bool meta)
+{
+  size_t sector_size = meta ? META_SECTOR_SIZE : BLOCK_SECTOR_SIZE;
+  struct cache_entry *e;
+
+  ASSERT (ofs + size <= sector_size);
+
+  /* No need to read the old contents if we overwrite them all. */
+  e = cache_get (sector, size < sector_size, false);
+  if (meta && size < sector_size)
+    verify (e);
+  memcpy (e->data + ofs, buffer, size);
+  e->dirty = true;
+  e->meta = meta;
+  e->verified = true;
+  cache_put (e);
+
+  lock_acquire (&cache_lock);
+  write_cnt++;
+  lock_release (&cache_lock);
+}
+
+#ifdef FS_CHECKSUM
+/* Checks the checksum of metadata entry E, if E has been read
+   from disk since it was last checked or written.  Panics if it
+   is wrong.  E's lock must be held. */
+static void
+verify (struct cache_entry *e)
+{
+  ASSERT (lock_held_by_current_thread (&e->lock));
+
+  if (!e->verified)
+    {
+      uint32_t stored;
+
+      memcpy (&stored, e->data + META_SECTOR_SIZE, sizeof stored);
+      if (crc32c (0, e->data, META_SECTOR_SIZE) != stored)
+        PANIC ("filesys: checksum mismatch in metadata sector %"PRDSNu,
+               e->sector);
+      e->verified = true;
+
+      lock_acquire (&cache_lock);
+      verify_cnt++;
+      lock_release (&cache_lock);
+    }
+}
+
+/* Stores the checksum of E in its last 4 bytes, if E holds a
+   metadata sector.  Called just before E is written back.  E's
+   lock must be held. */
+static void
+seal (struct cache_entry *e)
+{
+  ASSERT (lock_held_by_current_thread (&e->lock));
+
+  if (e->meta)
+    {
+      uint32_t crc = crc32c (0, e->data, META_SECTOR_SIZE);
+      memcpy (e->data + META_SECTOR_SIZE, &crc, sizeof crc);
+
+      lock_acquire (&cache_lock);
+      seal_cnt++;
+      lock_release (&cache_lock);
+    }
+}
+#else /* !FS_CHECKSUM */
+/* Without checksums, there is nothing to check or store. */
+static void
+verify (struct cache_entry *e UNUSED)
+{
+}
+
+static void
+seal (struct cache_entry *e UNUSED)
+{
+}
+#endif /* !FS_CHECKSUM */
+
+/* Asks for SECTOR to be read into the cache in the background.
+   The request is dropped if too many are already pending. */
+void
+cache_readahead (block_sector_t sector)
+{
+  lock_acquire (&readahead_lock);
+  if ((readahead_head + 1) % READAHEAD_QUEUE != readahead_tail)
+    {
+      readahead_queue[readahead_head] = sector;
+      readahead_head = (readahead_head + 1) % READAHEAD_QUEUE;
+      cond_signal (&readahead_ready, &readahead_lock);
+    }
+  lock_release (&readahead_lock);
+}
+
+/* Returns the number of sectors that a sequential reader should
+   currently keep ahead of itself. */
+size_t
+cache_readahead_limit (void)
+{
+  return readahead_limit;
+}
+
+/* Writes every dirty sector in the cache to disk. */
+void
+cache_flush (void)
+{
+  struct cache_entry *dirty[CACHE_CNT];
+  struct cache_entry *run[CACHE_CNT];
+  size_t dirty_cnt = 0;
+  size_t i, j;
+
+  /* Pin the dirty entries, so that they are not evicted while we
+     wait for their locks, and sort them by sector.  Peeking at
+     DIRTY without the entry's lock is only an optimization: it is
+     checked again below. */
+  lock_acquire (&cache_lock);
+  for (i = 0; i < CACHE_CNT; i++)
+    {
+      struct cache_entry *e = &cache[i];
+      if (e->sector == NO_SECTOR || !e->dirty)
+        continue;
+      e->pin_cnt++;
+      for (j = dirty_cnt++; j > 0 && dirty[j - 1]->sector > e->sector; j--)
+        dirty[j] = dirty[j - 1];
+      dirty[j] = e;
+    }
+  lock_release (&cache_lock);
+
+  /* Write them back a run of consecutive sectors at a time.
+     Locks are always taken in ascending sector order, so
+     concurrent flushes cannot deadlock. */
+  i = 0;
+  while (i < dirty_cnt)
+    {
+      size_t run_cnt = 0;
+
+      for (; i < dirty_cnt; i++)
+        {
+          struct cache_entry *e = dirty[i];
+          if (run_cnt > 0 && e->sector != run[run_cnt - 1]->sector + 1)
+            break;
+          lock_acquire (&e->lock);
+          if (!e->dirty)
+            {
+              /* Written back by someone else meanwhile. */
+              lock_release (&e->lock);
+              unpin (e);
+              i++;
+              break;
+            }
+          run[run_cnt++] = e;
+        }
+
+      write_back (run, run_cnt);
+      for (j = 0; j < run_cnt; j++)
+        {
+          lock_release (&run[j]->lock);
+          unpin (run[j]);
+        }
+    }
+}
+
+/* Prints buffer cache statistics. */
+void
+cache_print_stats (void)
+{
+  printf ("Buffer cache: %lld hits, %lld misses, %lld evictions, "
+          "%lld writes, %lld write-backs\n",
+          hit_cnt, miss_cnt, evict_cnt, write_cnt, writeback_cnt);
+  printf ("Read-ahead: %lld sectors prefetched, %lld hits, %lld wasted\n",
+          readahead_cnt, readahead_hit_cnt, readahead_waste_cnt);
+#ifdef FS_CHECKSUM
+  printf ("Checksums: %lld metadata sectors sealed, %lld verified (%s)\n",
+          seal_cnt, verify_cnt,
+          crc32c_hw_available () ? "SSE4.2" : "slicing-by-8");
+#endif
+}
+
+/* Returns the entry for SECTOR, pinned and with its lock held,
+   evicting another sector to make room if necessary.  If the
+   sector was not already cached and LOAD is true, reads it from
+   disk first.
+   If PREFETCH is true, the sector is being read ahead: returns a
+   null pointer if it is already cached or if every entry is in
+   use, and otherwise marks the new entry as prefetched. */
+static struct cache_entry *
+cache_get (block_sector_t sector, bool load, bool prefetch)
+{
+  struct cache_entry *e;
+  size_t i;
+
+  ASSERT (sector != NO_SECTOR);
+
+  lock_acquire (&cache_lock);
+  for (;;)
+    {
+      for (i = 0; i < CACHE_CNT; i++)
+        if (cache[i].sector == sector)
+          {
+            /* Hit.  If another thread is still reading the sector
+               in, acquiring the entry's lock waits for it to
+               finish. */
+            e = &cache[i];
+            if (prefetch)
+              {
+                lock_release (&cache_lock);
+                return NULL;
+              }
+            if (e->prefetched)
+              {
+                e->prefetched = false;
+                readahead_hit_cnt++;
+                readahead_outcome (true);
+              }
+            e->pin_cnt++;
+            hit_cnt++;
+            lock_release (&cache_lock);
+            lock_acquire (&e->lock);
+            return e;
+          }
+
+      /* Miss.  Advance the clock hand to an unpinned entry that
+         has not been used since the hand last passed it. */
+      e = NULL;
+      for (i = 0; i < 2 * CACHE_CNT; i++)
+        {
+          struct cache_entry *c = &cache[clock_hand];
+          clock_hand = (clock_hand + 1) % CACHE_CNT;
+          if (c->pin_cnt > 0)
+            continue;
+          if (!c->accessed)
+            {
+              e = c;
+              break;
+            }
+          c->accessed = false;
+        }
+
+      if (e == NULL && prefetch)
+        {
+          /* Read-ahead is only a hint, and the read-ahead thread
+             may itself hold pins, so don't wait. */
+          lock_release (&cache_lock);
+          return NULL;
+        }
+      else if (e == NULL)
+        {
+          /* Every entry is pinned.  Once one is released, SECTOR
+             may have been brought in by someone else, so start
+             over. */
+          cond_wait (&cache_unpinned, &cache_lock);
+          continue;
+        }
+
+      if (e->dirty)
+        {
+          /* Write back the victim before reusing it.  It keeps its
+             old sector meanwhile, so that nobody reads a stale copy
+             of that sector from disk, and we start over afterward
+             because the cache may have changed while we waited. */
+          e->pin_cnt++;
+          lock_release (&cache_lock);
+          lock_acquire (&e->lock);
+          if (e->dirty)
+            write_back (&e, 1);
+          lock_release (&e->lock);
+          lock_acquire (&cache_lock);
+          if (--e->pin_cnt == 0)
+            cond_signal (&cache_unpinned, &cache_lock);
+          continue;
+        }
+      break;
+    }
+
+  /* Take over the clean, unpinned victim. */
+  if (prefetch)
+    readahead_cnt++;
+  else
+    miss_cnt++;
+  if (e->sector != NO_SECTOR)
+    evict_cnt++;
+  if (e->prefetched)
+    {
+      readahead_waste_cnt++;
+      readahead_outcome (false);
+    }
+  e->sector = sector;
+  e->prefetched = prefetch;
+  e->meta = false;
+  e->verified = !load && !prefetch;
+  e->pin_cnt++;
+
+  /* Nobody else holds the lock of an unpinned entry, so this
+     does not block, and holding it keeps other threads that look
+     up SECTOR from seeing the entry before it is loaded. */
+  lock_acquire (&e->lock);
+  lock_release (&cache_lock);
+
+  if (load)
+    block_read (fs_device, sector, e->data);
+  return e;
+}
+
+/* Unlocks and unpins entry E, which was obtained from
+   cache_get(). */
+static void
+cache_put (struct cache_entry *e)
+{
+  lock_release (&e->lock);
+
+  lock_acquire (&cache_lock);
+  e->accessed = true;
+  if (--e->pin_cnt == 0)
+    cond_signal (&cache_unpinned, &cache_lock);
+  lock_release (&cache_lock);
+}
+
+/* Unpins entry E without counting it as used. */
+static void
+unpin (struct cache_entry *e)
+{
+  lock_acquire (&cache_lock);
+  if (--e->pin_cnt == 0)
+    cond_signal (&cache_unpinned, &cache_lock);
+  lock_release (&cache_lock);
+}
+
+/* Writes the CNT dirty entries in RUN, which hold consecutive
+   sectors in ascending order, to disk with a single request.
+   Their locks must be held. */
+static void
+write_back (struct cache_entry *run[], size_t cnt)
+{
+  const void *buffers[CACHE_CNT];
+  size_t i;
+
+  ASSERT (cnt <= CACHE_CNT);
+  if (cnt == 0)
+    return;
+
+  for (i = 0; i < cnt; i++)
+    {
+      ASSERT (lock_held_by_current_thread (&run[i]->lock));
+      ASSERT (run[i]->dirty);
+      ASSERT (run[i]->sector == run[0]->sector + i);
+      seal (run[i]);
+      buffers[i] = run[i]->data;
+    }
+  block_write_multiple (fs_device, run[0]->sector, cnt, buffers);
+  for (i = 0; i < cnt; i++)
+    run[i]->dirty = false;
+
+  lock_acquire (&cache_lock);
+  writeback_cnt += cnt;
+  lock_release (&cache_lock);
+}
+
+/* Reads the CNT entries in RUN, which were just obtained from
+   cache_get() for consecutive sectors in ascending order, from
+   disk with a single request, then unlocks and unpins them. */
+static void
+read_run (struct cache_entry *run[], size_t cnt)
+{
+  void *buffers[READAHEAD_RUN];
+  size_t i;
+
+  ASSERT (cnt <= READAHEAD_RUN);
+  if (cnt == 0)
+    return;
+
+  for (i = 0; i < cnt; i++)
+    buffers[i] = run[i]->data;
+  block_read_multiple (fs_device, run[0]->sector, cnt, buffers);
+  for (i = 0; i < cnt; i++)
+    {
+      lock_release (&run[i]->lock);
+      unpin (run[i]);
+    }
+}
+
+/* Records whether a prefetched sector was USED before it was
+   evicted, and once per epoch adjusts the read-ahead window:
+   shrinks it if most prefetches were wasted, grows it if almost
+   none were.  cache_lock must be held. */
+static void
+readahead_outcome (bool used)
+{
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+
+  if (used)
+    epoch_hit_cnt++;
+  else
+    epoch_waste_cnt++;
+
+  if (epoch_hit_cnt + epoch_waste_cnt >= READAHEAD_EPOCH)
+    {
+      if (epoch_waste_cnt > epoch_hit_cnt)
+        readahead_limit = readahead_limit > 1 ? readahead_limit / 2 : 1;
+      else if (epoch_waste_cnt * 8 < READAHEAD_EPOCH)
+        readahead_limit = (readahead_limit < READAHEAD_MAX
+                           ? readahead_limit * 2 : READAHEAD_MAX);
+      epoch_hit_cnt = epoch_waste_cnt = 0;
+    }
+}
+
+/* Read-ahead worker thread.  Reads queued sectors into the
+   cache. */
+static void
+readahead_daemon (void *aux UNUSED)
+{
+  for (;;)
+    {
+      block_sector_t sectors[READAHEAD_RUN];
+      struct cache_entry *run[READAHEAD_RUN];
+      size_t sector_cnt = 0, run_cnt = 0;
+      size_t i;
+
+      /* Take the next queued sector, along with any queued after
+         it that follow it on disk. */
+      lock_acquire (&readahead_lock);
+      while (readahead_head == readahead_tail)
+        cond_wait (&readahead_ready, &readahead_lock);
+      do
+        {
+          sectors[sector_cnt++] = readahead_queue[readahead_tail];
+          readahead_tail = (readahead_tail + 1) % READAHEAD_QUEUE;
+        }
+      while (sector_cnt < READAHEAD_RUN && readahead_tail != readahead_head
+             && (readahead_queue[readahead_tail]
+                 == sectors[sector_cnt - 1] + 1));
+      lock_release (&readahead_lock);
+
+      /* Claim entries for the sectors that are not yet cached and
+         read each run of them with one request.  The entries are
+         left unaccessed, so that they are the first to go if
+         nobody uses them. */
+      for (i = 0; i < sector_cnt; i++)
+        {
+          struct cache_entry *e = cache_get (sectors[i], false, true);
+          if (e != NULL)
+            run[run_cnt++] = e;
+          else
+            {
+              read_run (run, run_cnt);
+              run_cnt = 0;
+            }
+        }
+      read_run (run, run_cnt);
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef FILESYS_CACHE_H
+#define FILESYS_CACHE_H
+
+#include <stddef.h>
+#include "devices/block.h"
+
+/* Number of bytes of a metadata sector that can hold data.  With
+   FS_CHECKSUM, the rest of the sector holds its checksum. */
+#ifdef FS_CHECKSUM
+#define META_SECTOR_SIZE (BLOCK_SECTOR_SIZE - 4)
+#else
+#define META_SECTOR_SIZE BLOCK_SECTOR_SIZE
+#endif
+
+void cache_init (void);
+void cache_read (block_sector_t, void *, size_t ofs, size_t size);
+void cache_write (block_sector_t, const void *, size_t ofs, size_t size);
+void cache_read_meta (block_sector_t, void *, size_t ofs, size_t size);
+void cache_write_meta (block_sector_t, const void *, size_t ofs,
+                       size_t size);
+void cache_readahead (block_sector_t);
+size_t cache_readahead_limit (void);
+void cache_flush (void);
+void cache_print_stats (void);
+
+#endif /* filesys/cache.h */
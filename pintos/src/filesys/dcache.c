@@ -0,0 +1,224 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Directory entry cache.
+
+   Remembers the results of recent directory lookups, keyed by
+   the sector of the directory's inode and the name looked up,
+   so that resolving a path that was resolved recently needs no
+   directory reads.  Names that were found not to exist are
+   remembered too (negative entries), since programs often look
+   for files that are not there.
+
+   At most DCACHE_CNT entries are kept; the least recently used
+   one is replaced when a new one is needed.  Directory code must
+   call dcache_invalidate() whenever it adds or removes a name,
+   and dcache_invalidate_dir() when a directory is deleted. */
+
+/* Maximum number of cached names. */
+#define DCACHE_CNT 128
+
+/* A cached name. */
+struct dentry
+  {
+    struct hash_elem hash_elem;         /* Element in `dentries'. */
+    struct list_elem lru_elem;          /* Element in `lru'. */
+    block_sector_t dir;                 /* Directory inode sector. */
+    char name[NAME_MAX + 1];            /* Null terminated name. */
+    bool exists;                        /* False for negative entry. */
+    block_sector_t inode_sector;        /* Inode sector, if EXISTS. */
+  };
+
+static struct dentry dentries_buf[DCACHE_CNT]; /* Storage for entries. */
+static struct hash dentries;            /* Cached names. */
+static struct list lru;                 /* Most recently used first. */
+static struct list free_dentries;       /* Unused entries. */
+static struct lock dcache_lock;         /* Protects all of the above. */
+
+/* Statistics. */
+static long long hit_cnt, negative_cnt, miss_cnt;
+
+static hash_hash_func dentry_hash;
+static hash_less_func dentry_less;
+static struct dentry *find (block_sector_t dir, const char *name);
+static void discard (struct dentry *);
+
+/* Initializes the directory entry cache. */
+void
+dcache_init (void)
+{
+  size_t i;
+
+  lock_init (&dcache_lock);
+  list_init (&lru);
+  list_init (&free_dentries);
+  if (!hash_init (&dentries, dentry_hash, dentry_less, NULL))
+    PANIC ("dcache: hash table creation failed");
+  for (i = 0; i < DCACHE_CNT; i++)
+    list_push_back (&free_dentries, &dentries_buf[i].lru_elem);
+}
+
+/* Looks up NAME in the directory whose inode is in sector DIR.
+   If the name is cached as existing, stores the sector of its
+   inode in *INODE_SECTOR and returns DCACHE_HIT.  Returns
+   DCACHE_NEGATIVE if it is cached as not existing, DCACHE_MISS
+   if nothing is known. */
+enum dcache_result
+dcache_lookup (block_sector_t dir, const char *name,
+               block_sector_t *inode_sector)
+{
+  enum dcache_result result = DCACHE_MISS;
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d != NULL)
+    {
+      list_remove (&d->lru_elem);
+      list_push_front (&lru, &d->lru_elem);
+      if (d->exists)
+        {
+          *inode_sector = d->inode_sector;
+          result = DCACHE_HIT;
+          hit_cnt++;
+        }
+      else
+        {
+          result = DCACHE_NEGATIVE;
+          negative_cnt++;
+        }
+    }
+  else
+    miss_cnt++;
+  lock_release (&dcache_lock);
+
+  return result;
+}
+
+/* Records that NAME exists in the directory whose inode is in
+   sector DIR, with its inode in INODE_SECTOR, if EXISTS is true,
+   or that it does not exist if EXISTS is false. */
+void
+dcache_insert (block_sector_t dir, const char *name, bool exists,
+               block_sector_t inode_sector)
+{
+  struct dentry *d;
+
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d != NULL)
+    list_remove (&d->lru_elem);
+  else
+    {
+      if (list_empty (&free_dentries))
+        discard (list_entry (list_back (&lru), struct dentry, lru_elem));
+      d = list_entry (list_pop_front (&free_dentries),
+                      struct dentry, lru_elem);
+      d->dir = dir;
+      strlcpy (d->name, name, sizeof d->name);
+      hash_insert (&dentries, &d->hash_elem);
+    }
+  d->exists = exists;
+  d->inode_sector = inode_sector;
+  list_push_front (&lru, &d->lru_elem);
+  lock_release (&dcache_lock);
+}
+
+/* Forgets anything cached about NAME in the directory whose
+   inode is in sector DIR. */
+void
+dcache_invalidate (block_sector_t dir, const char *name)
+{
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d != NULL)
+    discard (d);
+  lock_release (&dcache_lock);
+}
+
+/* Forgets everything cached about names in the directory whose
+   inode is in sector DIR, and about the directory itself under
+   any name. */
+void
+dcache_invalidate_dir (block_sector_t dir)
+{
+  struct list_elem *e, *next;
+
+  lock_acquire (&dcache_lock);
+  for (e = list_begin (&lru); e != list_end (&lru); e = next)
+    {
+      struct dentry *d = list_entry (e, struct dentry, lru_elem);
+      next = list_next (e);
+      if (d->dir == dir || (d->exists && d->inode_sector == dir))
+        discard (d);
+    }
+  lock_release (&dcache_lock);
+}
+
+/* Prints directory entry cache statistics. */
+void
+dcache_print_stats (void)
+{
+  printf ("Name cache: %lld hits, %lld negative hits, %lld misses\n",
+          hit_cnt, negative_cnt, miss_cnt);
+}
+
+/* Returns the entry for NAME in DIR, or a null pointer if there
+   is none.  dcache_lock must be held. */
+static struct dentry *
+find (block_sector_t dir, const char *name)
+{
+  struct dentry key;
+  struct hash_elem *e;
+
+  ASSERT (lock_held_by_current_thread (&dcache_lock));
+
+  if (strlen (name) > NAME_MAX)
+    return NULL;
+  key.dir = dir;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dentries, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dentry, hash_elem) : NULL;
+}
+
+/* Removes D from the cache and makes it available for reuse.
+   dcache_lock must be held. */
+static void
+discard (struct dentry *d)
+{
+  hash_delete (&dentries, &d->hash_elem);
+  list_remove (&d->lru_elem);
+  list_push_front (&free_dentries, &d->lru_elem);
+}
+
+/* Returns a hash value for dentry E. */
+static unsigned
+dentry_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct dentry *d = hash_entry (e, struct dentry, hash_elem);
+  return hash_string (d->name) ^ hash_int (d->dir);
+}
+
+/* Returns true if dentry A precedes dentry B. */
+static bool
+dentry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+             void *aux UNUSED)
+{
+  const struct dentry *a = hash_entry (a_, struct dentry, hash_elem);
+  const struct dentry *b = hash_entry (b_, struct dentry, hash_elem);
+  if (a->dir != b->dir)
+    return a->dir < b->dir;
+  return strcmp (a->name, b->name) < 0;
+}
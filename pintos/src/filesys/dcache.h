@@ -0,0 +1,24 @@
+#ifndef FILESYS_DCACHE_H
+#define FILESYS_DCACHE_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+/* Result of a name cache lookup. */
+enum dcache_result
+  {
+    DCACHE_MISS,                /* Nothing known about the name. */
+    DCACHE_NEGATIVE,            /* Known not to exist. */
+    DCACHE_HIT                  /* Known to exist. */
+  };
+
+void dcache_init (void);
+enum dcache_result dcache_lookup (block_sector_t dir, const char *name,
+                                  block_sector_t *inode_sector);
+void dcache_insert (block_sector_t dir, const char *name, bool exists,
+                    block_sector_t inode_sector);
+void dcache_invalidate (block_sector_t dir, const char *name);
+void dcache_invalidate_dir (block_sector_t dir);
+void dcache_print_stats (void);
+
+#endif /* filesys/dcache.h */
@@ -1,10 +1,13 @@
 #include "filesys/directory.h"
 #include <stdio.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
 /* A directory. */
 struct dir 
@@ -21,12 +24,96 @@ struct dir_entry
     bool in_use;                        /* In use or free? */
   };
 
+/* In-memory index of the entries in a directory, built the first
+   time the directory is searched, so that later searches need
+   not read the directory at all.
+
+   Directories are opened and closed around every operation, so
+   indexes are not tied to open directories.  Instead, the
+   INDEX_CNT most recently used are kept, keyed by the sector of
+   the directory's inode, and each is updated by dir_add() and
+   dir_remove() along with the directory itself.  An index is
+   discarded when its directory is deleted or created anew, since
+   its sector may be reused. */
+struct dir_index
+  {
+    struct list_elem elem;              /* Element in `indexes'. */
+    block_sector_t sector;              /* Directory's inode sector. */
+    struct hash names;                  /* Contains struct index_entry. */
+    off_t free_ofs;                     /* No free slots before this. */
+  };
+
+/* An in-use directory entry in a struct dir_index. */
+struct index_entry
+  {
+    struct hash_elem elem;              /* Element in dir_index's names. */
+    char name[NAME_MAX + 1];            /* Null terminated file name. */
+    block_sector_t inode_sector;        /* Sector number of header. */
+    off_t ofs;                          /* Offset of entry in directory. */
+  };
+
+/* Maximum number of directory indexes kept. */
+#define INDEX_CNT 16
+
+/* Directory indexes, most recently used first. */
+static struct list indexes;
+
+/* Protects `indexes' and the indexes in it.  Never held while
+   reading a directory from disk. */
+static struct lock index_lock;
+
+static struct dir_index *get_index (const struct dir *);
+static struct dir_index *find_index (block_sector_t);
+static struct dir_index *build_index (const struct dir *);
+static struct index_entry *index_find (struct dir_index *, const char *);
+static void index_add (const struct dir *, const struct dir_entry *,
+                       off_t ofs);
+static void index_remove (const struct dir *, const char *name, off_t ofs);
+static void index_discard (block_sector_t);
+static bool is_empty (struct inode *);
+
+/* Initializes the directory module. */
+void
+dir_init (void) 
+{
+  list_init (&indexes);
+  lock_init (&index_lock);
+}
+
 /* Creates a directory with space for ENTRY_CNT entries in the
-   given SECTOR.  Returns true if successful, false on failure. */
+   given SECTOR, whose parent directory is in sector PARENT.
+   The directory grows if more entries are added.
+   Its first two entries are "." and "..", which refer to the
+   directory itself and to PARENT.
+   Returns true if successful, false on failure. */
 bool
-dir_create (block_sector_t sector, size_t entry_cnt)
+dir_create (block_sector_t sector, block_sector_t parent, size_t entry_cnt)
 {
-  return inode_create (sector, entry_cnt * sizeof (struct dir_entry));
+  struct inode *inode;
+  struct dir_entry e[2];
+  bool success;
+
+  ASSERT (entry_cnt >= 2);
+
+  index_discard (sector);
+  dcache_invalidate_dir (sector);
+  if (!inode_create (sector, entry_cnt * sizeof (struct dir_entry), true))
+    return false;
+
+  memset (e, 0, sizeof e);
+  e[0].inode_sector = sector;
+  strlcpy (e[0].name, ".", sizeof e[0].name);
+  e[0].in_use = true;
+  e[1].inode_sector = parent;
+  strlcpy (e[1].name, "..", sizeof e[1].name);
+  e[1].in_use = true;
+
+  inode = inode_open (sector);
+  if (inode == NULL)
+    return false;
+  success = inode_write_at (inode, e, sizeof e, 0) == sizeof e;
+  inode_close (inode);
+  return success;
 }
 
 /* Opens and returns the directory for the given INODE, of which
@@ -93,11 +180,34 @@ lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
 {
   struct dir_entry e;
+  struct dir_index *index;
   size_t ofs;
   
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  lock_acquire (&index_lock);
+  index = get_index (dir);
+  if (index != NULL)
+    {
+      struct index_entry *ie = index_find (index, name);
+      if (ie != NULL)
+        {
+          if (ep != NULL)
+            {
+              ep->inode_sector = ie->inode_sector;
+              strlcpy (ep->name, ie->name, sizeof ep->name);
+              ep->in_use = true;
+            }
+          if (ofsp != NULL)
+            *ofsp = ie->ofs;
+        }
+      lock_release (&index_lock);
+      return ie != NULL;
+    }
+  lock_release (&index_lock);
+
+  /* Not enough memory for an index: search the slow way. */
   for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e) 
     if (e.in_use && !strcmp (name, e.name)) 
@@ -114,20 +224,55 @@ lookup (const struct dir *dir, const char *name,
 /* Searches DIR for a file with the given NAME
    and returns true if one exists, false otherwise.
    On success, sets *INODE to an inode for the file, otherwise to
-   a null pointer.  The caller must close *INODE. */
+   a null pointer.  The caller must close *INODE.
+   Finds nothing in a directory that has been removed, not even
+   "." or "..", although a thread whose working directory it is
+   may still hold it open.
+   Consults the directory entry cache first.
+
+   DIR's lock is held throughout, as it is by dir_add() and
+   dir_remove(), so that what is found and what is then put in
+   the directory entry cache cannot be overtaken by a change to
+   DIR, and so that an inode found cannot be removed before it is
+   opened. */
 bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode) 
 {
+  block_sector_t dir_sector, inode_sector;
   struct dir_entry e;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
-  else
-    *inode = NULL;
+  dir_sector = inode_get_inumber (dir->inode);
+  *inode = NULL;
+  inode_lock_dir (dir->inode);
+  if (inode_is_removed (dir->inode))
+    {
+      inode_unlock_dir (dir->inode);
+      return false;
+    }
+  switch (dcache_lookup (dir_sector, name, &inode_sector))
+    {
+    case DCACHE_HIT:
+      *inode = inode_open (inode_sector);
+      break;
+
+    case DCACHE_NEGATIVE:
+      break;
+
+    case DCACHE_MISS:
+      if (lookup (dir, name, &e, NULL))
+        {
+          dcache_insert (dir_sector, name, true, e.inode_sector);
+          *inode = inode_open (e.inode_sector);
+        }
+      else
+        dcache_insert (dir_sector, name, false, 0);
+      break;
+    }
+  inode_unlock_dir (dir->inode);
 
   return *inode != NULL;
 }
@@ -142,6 +287,7 @@ bool
 dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 {
   struct dir_entry e;
+  struct dir_index *index;
   off_t ofs;
   bool success = false;
 
@@ -152,18 +298,29 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
+  /* Nothing may be added to a deleted directory.  Holding DIR's
+     lock keeps it from being deleted until we are done. */
+  inode_lock_dir (dir->inode);
+  if (inode_is_removed (dir->inode))
+    goto done;
+
   /* Check that NAME is not in use. */
   if (lookup (dir, name, NULL, NULL))
     goto done;
 
   /* Set OFS to offset of free slot.
      If there are no free slots, then it will be set to the
-     current end-of-file.
+     current end-of-file.  The directory's index, if it has one,
+     knows where to start looking.
      
      inode_read_at() will only return a short read at end of file.
      Otherwise, we'd need to verify that we didn't get a short
      read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  lock_acquire (&index_lock);
+  index = get_index (dir);
+  ofs = index != NULL ? index->free_ofs : 0;
+  lock_release (&index_lock);
+  for (; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e) 
     if (!e.in_use)
       break;
@@ -173,8 +330,17 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   strlcpy (e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
   success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  if (success)
+    {
+      index_add (dir, &e, ofs);
+      dcache_insert (inode_get_inumber (dir->inode), name, true,
+                     inode_sector);
+    }
+  else
+    dcache_invalidate (inode_get_inumber (dir->inode), name);
 
  done:
+  inode_unlock_dir (dir->inode);
   return success;
 }
 
@@ -186,13 +352,19 @@ dir_remove (struct dir *dir, const char *name)
 {
   struct dir_entry e;
   struct inode *inode = NULL;
+  bool locked = false;
   bool success = false;
   off_t ofs;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  /* A directory's "." and ".." entries stay as long as it does. */
+  if (!strcmp (name, ".") || !strcmp (name, ".."))
+    return false;
+
   /* Find directory entry. */
+  inode_lock_dir (dir->inode);
   if (!lookup (dir, name, &e, &ofs))
     goto done;
 
@@ -201,23 +373,43 @@ dir_remove (struct dir *dir, const char *name)
   if (inode == NULL)
     goto done;
 
+  /* Only empty directories may be removed.  The directory's own
+     lock, always taken after its parent's, keeps anything from
+     being added to it while it is checked and removed. */
+  if (inode_is_dir (inode))
+    {
+      inode_lock_dir (inode);
+      locked = true;
+      if (!is_empty (inode))
+        goto done;
+    }
+
   /* Erase directory entry. */
   e.in_use = false;
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
     goto done;
 
-  /* Remove inode. */
+  index_remove (dir, name, ofs);
+  dcache_insert (inode_get_inumber (dir->inode), name, false, 0);
+
+  /* Remove inode.  If it is a directory, its index and cached
+     names go too. */
+  index_discard (e.inode_sector);
+  dcache_invalidate_dir (e.inode_sector);
   inode_remove (inode);
   success = true;
 
  done:
+  if (locked)
+    inode_unlock_dir (inode);
   inode_close (inode);
+  inode_unlock_dir (dir->inode);
   return success;
 }
 
 /* Reads the next directory entry in DIR and stores the name in
    NAME.  Returns true if successful, false if the directory
-   contains no more entries. */
+   contains no more entries.  Never returns "." or "..". */
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
@@ -226,7 +418,7 @@ dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
   while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
     {
       dir->pos += sizeof e;
-      if (e.in_use)
+      if (e.in_use && strcmp (e.name, ".") && strcmp (e.name, ".."))
         {
           strlcpy (name, e.name, NAME_MAX + 1);
           return true;
@@ -234,3 +426,248 @@ dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
     }
   return false;
 }
+
+/* Returns true if directory INODE contains no entries other
+   than "." and "..". */
+static bool
+is_empty (struct inode *inode)
+{
+  struct dir_entry e;
+  off_t ofs;
+
+  for (ofs = 0; inode_read_at (inode, &e, sizeof e, ofs) == sizeof e;
+       ofs += sizeof e)
+    if (e.in_use && strcmp (e.name, ".") && strcmp (e.name, ".."))
+      return false;
+  return true;
+}
+
+/* Hash function for index entries. */
+static unsigned
+index_entry_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct index_entry *ie = hash_entry (e, struct index_entry, elem);
+  return hash_string (ie->name);
+}
+
+/* Comparison function for index entries. */
+static bool
+index_entry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+                  void *aux UNUSED)
+{
+  const struct index_entry *a = hash_entry (a_, struct index_entry, elem);
+  const struct index_entry *b = hash_entry (b_, struct index_entry, elem);
+  return strcmp (a->name, b->name) < 0;
+}
+
+/* Frees an index entry. */
+static void
+index_entry_free (struct hash_elem *e, void *aux UNUSED)
+{
+  free (hash_entry (e, struct index_entry, elem));
+}
+
+/* Frees INDEX, which must not be in `indexes'. */
+static void
+index_free (struct dir_index *index)
+{
+  hash_destroy (&index->names, index_entry_free);
+  free (index);
+}
+
+/* Adds an entry for NAME to INDEX.  Returns false if out of
+   memory. */
+static bool
+index_insert (struct dir_index *index, const char *name,
+              block_sector_t inode_sector, off_t ofs)
+{
+  struct index_entry *ie = malloc (sizeof *ie);
+  if (ie == NULL)
+    return false;
+  strlcpy (ie->name, name, sizeof ie->name);
+  ie->inode_sector = inode_sector;
+  ie->ofs = ofs;
+  hash_insert (&index->names, &ie->elem);
+  return true;
+}
+
+/* Returns the index for DIR, reading DIR to build it if
+   necessary, or a null pointer if memory is short.
+   index_lock must be held.  It is released while DIR is read, so
+   that operations on other directories need not wait for the
+   disk, and reacquired before returning. */
+static struct dir_index *
+get_index (const struct dir *dir)
+{
+  block_sector_t sector = inode_get_inumber (dir->inode);
+  struct dir_index *index, *other;
+
+  ASSERT (lock_held_by_current_thread (&index_lock));
+
+  index = find_index (sector);
+  if (index != NULL)
+    return index;
+
+  lock_release (&index_lock);
+  index = build_index (dir);
+  lock_acquire (&index_lock);
+
+  /* Another thread may have built an index for DIR while the
+     lock was released.  Its index is at least as up to date as
+     ours, because dir_add() and dir_remove() update an index in
+     the list after changing the directory, and ours may have been
+     read before such a change. */
+  other = find_index (sector);
+  if (other != NULL || index == NULL)
+    {
+      if (index != NULL)
+        index_free (index);
+      return other;
+    }
+
+  list_push_front (&indexes, &index->elem);
+  if (list_size (&indexes) > INDEX_CNT)
+    index_free (list_entry (list_pop_back (&indexes),
+                            struct dir_index, elem));
+  return index;
+}
+
+/* Returns the index for the directory whose inode is in SECTOR,
+   moving it to the front of `indexes', or a null pointer if
+   there is none.  index_lock must be held. */
+static struct dir_index *
+find_index (block_sector_t sector)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&indexes); e != list_end (&indexes);
+       e = list_next (e))
+    {
+      struct dir_index *index = list_entry (e, struct dir_index, elem);
+      if (index->sector == sector)
+        {
+          list_remove (&index->elem);
+          list_push_front (&indexes, &index->elem);
+          return index;
+        }
+    }
+  return NULL;
+}
+
+/* Reads DIR and returns a new index of its entries, which is not
+   yet in `indexes', or a null pointer if memory is short. */
+static struct dir_index *
+build_index (const struct dir *dir)
+{
+  struct dir_index *index;
+  struct dir_entry de;
+  off_t ofs;
+
+  index = malloc (sizeof *index);
+  if (index == NULL)
+    return NULL;
+  if (!hash_init (&index->names, index_entry_hash, index_entry_less, NULL))
+    {
+      free (index);
+      return NULL;
+    }
+  index->sector = inode_get_inumber (dir->inode);
+  index->free_ofs = -1;
+  for (ofs = 0; inode_read_at (dir->inode, &de, sizeof de, ofs) == sizeof de;
+       ofs += sizeof de)
+    {
+      if (!de.in_use)
+        {
+          if (index->free_ofs < 0)
+            index->free_ofs = ofs;
+        }
+      else if (!index_insert (index, de.name, de.inode_sector, ofs))
+        {
+          index_free (index);
+          return NULL;
+        }
+    }
+  if (index->free_ofs < 0)
+    index->free_ofs = ofs;
+  return index;
+}
+
+/* Returns the entry for NAME in INDEX, or a null pointer if
+   there is none.  index_lock must be held. */
+static struct index_entry *
+index_find (struct dir_index *index, const char *name)
+{
+  struct index_entry key;
+  struct hash_elem *e;
+
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&index->names, &key.elem);
+  return e != NULL ? hash_entry (e, struct index_entry, elem) : NULL;
+}
+
+/* Records that entry E was written at OFS in DIR. */
+static void
+index_add (const struct dir *dir, const struct dir_entry *e, off_t ofs)
+{
+  struct dir_index *index;
+
+  lock_acquire (&index_lock);
+  index = get_index (dir);
+  if (index != NULL)
+    {
+      /* The new entry may have been read in by get_index(). */
+      if (index_find (index, e->name) == NULL
+          && !index_insert (index, e->name, e->inode_sector, ofs))
+        {
+          list_remove (&index->elem);
+          index_free (index);
+        }
+      else if (index->free_ofs == ofs)
+        index->free_ofs = ofs + sizeof *e;
+    }
+  lock_release (&index_lock);
+}
+
+/* Records that the entry for NAME at OFS in DIR was erased. */
+static void
+index_remove (const struct dir *dir, const char *name, off_t ofs)
+{
+  struct dir_index *index;
+
+  lock_acquire (&index_lock);
+  index = get_index (dir);
+  if (index != NULL)
+    {
+      struct index_entry *ie = index_find (index, name);
+      if (ie != NULL)
+        {
+          hash_delete (&index->names, &ie->elem);
+          free (ie);
+        }
+      if (ofs < index->free_ofs)
+        index->free_ofs = ofs;
+    }
+  lock_release (&index_lock);
+}
+
+/* Discards the index for the directory whose inode is in SECTOR,
+   if there is one. */
+static void
+index_discard (block_sector_t sector)
+{
+  struct list_elem *e;
+
+  lock_acquire (&index_lock);
+  for (e = list_begin (&indexes); e != list_end (&indexes);
+       e = list_next (e))
+    {
+      struct dir_index *index = list_entry (e, struct dir_index, elem);
+      if (index->sector == sector)
+        {
+          list_remove (&index->elem);
+          index_free (index);
+          break;
+        }
+    }
+  lock_release (&index_lock);
+}
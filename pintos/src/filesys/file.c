@@ -1,5 +1,6 @@
 #include "filesys/file.h"
 #include <debug.h>
+#include "filesys/cache.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
 
@@ -9,8 +10,12 @@ struct file
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+    off_t ra_next;              /* Where a sequential read would start. */
+    off_t ra_end;               /* End of data already read ahead. */
   };
 
+static void read_ahead (struct file *, off_t offset, off_t size);
+
 /* Opens a file for the given INODE, of which it takes ownership,
    and returns the new file.  Returns a null pointer if an
    allocation fails or if INODE is null. */
@@ -23,6 +28,7 @@ file_open (struct inode *inode)
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      file->ra_next = file->ra_end = 0;
       return file;
     }
   else
@@ -69,6 +75,7 @@ off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
   off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+  read_ahead (file, file->pos, bytes_read);
   file->pos += bytes_read;
   return bytes_read;
 }
@@ -81,15 +88,16 @@ file_read (struct file *file, void *buffer, off_t size)
 off_t
 file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs) 
 {
-  return inode_read_at (file->inode, buffer, size, file_ofs);
+  off_t bytes_read = inode_read_at (file->inode, buffer, size, file_ofs);
+  read_ahead (file, file_ofs, bytes_read);
+  return bytes_read;
 }
 
 /* Writes SIZE bytes from BUFFER into FILE,
    starting at the file's current position.
    Returns the number of bytes actually written,
-   which may be less than SIZE if end of file is reached.
-   (Normally we'd grow the file in that case, but file growth is
-   not yet implemented.)
+   which may be less than SIZE if the disk fills up.
+   Writing past end of file grows the file.
    Advances FILE's position by the number of bytes read. */
 off_t
 file_write (struct file *file, const void *buffer, off_t size) 
@@ -102,9 +110,8 @@ file_write (struct file *file, const void *buffer, off_t size)
 /* Writes SIZE bytes from BUFFER into FILE,
    starting at offset FILE_OFS in the file.
    Returns the number of bytes actually written,
-   which may be less than SIZE if end of file is reached.
-   (Normally we'd grow the file in that case, but file growth is
-   not yet implemented.)
+   which may be less than SIZE if the disk fills up.
+   Writing past end of file grows the file.
    The file's current position is unaffected. */
 off_t
 file_write_at (struct file *file, const void *buffer, off_t size,
@@ -166,3 +173,32 @@ file_tell (struct file *file)
   ASSERT (file != NULL);
   return file->pos;
 }
+
+/* Notes that SIZE bytes were just read from FILE at OFFSET.  If
+   the read continued where the previous one left off, starts
+   reading the sectors that follow into the buffer cache, keeping
+   cache_readahead_limit() sectors ahead of the reader. */
+static void
+read_ahead (struct file *file, off_t offset, off_t size) 
+{
+  off_t window_end;
+
+  if (size <= 0)
+    return;
+  if (offset != file->ra_next)
+    {
+      /* Random access: stop reading ahead. */
+      file->ra_next = file->ra_end = offset + size;
+      return;
+    }
+
+  file->ra_next = offset + size;
+  if (file->ra_end < file->ra_next)
+    file->ra_end = file->ra_next;
+  window_end = file->ra_next + cache_readahead_limit () * BLOCK_SECTOR_SIZE;
+  if (file->ra_end < window_end)
+    {
+      inode_read_ahead (file->inode, file->ra_end, window_end);
+      file->ra_end = window_end;
+    }
+}
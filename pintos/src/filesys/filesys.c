@@ -2,15 +2,23 @@
 #include <debug.h>
 #include <stdio.h>
 #include <string.h>
+#include "filesys/cache.h"
+#include "filesys/dcache.h"
 #include "filesys/file.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
+#include "devices/timer.h"
+#include "threads/thread.h"
 
 /* Partition that contains the file system. */
 struct block *fs_device;
 
+/* Timer ticks between background flushes of dirty data. */
+#define FLUSH_INTERVAL (5 * TIMER_FREQ)
+
 static void do_format (void);
+static thread_func flush_daemon NO_RETURN;
 
 /* Initializes the file system module.
    If FORMAT is true, reformats the file system. */
@@ -21,13 +29,18 @@ filesys_init (bool format)
   if (fs_device == NULL)
     PANIC ("No file system device found, can't initialize file system.");
 
+  cache_init ();
   inode_init ();
+  dir_init ();
+  dcache_init ();
   free_map_init ();
 
   if (format) 
     do_format ();
 
   free_map_open ();
+
+  thread_create ("fs-flush", PRI_DEFAULT, flush_daemon, NULL);
 }
 
 /* Shuts down the file system module, writing any unwritten data
@@ -36,8 +49,118 @@ void
 filesys_done (void) 
 {
   free_map_close ();
+  cache_flush ();
+}
+
+/* Periodically writes the free map and dirty cached sectors to
+   disk, so that little is lost if the machine stops without
+   calling filesys_done(). */
+static void
+flush_daemon (void *aux UNUSED)
+{
+  for (;;)
+    {
+      timer_sleep (FLUSH_INTERVAL);
+      free_map_flush ();
+      cache_flush ();
+    }
 }
 
+/* Returns a new handle for the current thread's working
+   directory, or the root directory if it has none.  Returns a
+   null pointer if memory is short. */
+static struct dir *
+open_cwd (void)
+{
+  struct dir *cwd = thread_current ()->cwd;
+  return cwd != NULL ? dir_reopen (cwd) : dir_open_root ();
+}
+
+/* Extracts the next component of the path in *SRCP into PART
+   and advances *SRCP past it.  Returns 1 if successful, 0 at
+   end of string, -1 if the component is too long. */
+static int
+next_part (char part[NAME_MAX + 1], const char **srcp)
+{
+  const char *src = *srcp;
+  char *dst = part;
+
+  /* Skip leading slashes.  If it's all slashes, we're done. */
+  while (*src == '/')
+    src++;
+  if (*src == '\0')
+    return 0;
+
+  /* Copy up to NAME_MAX characters from SRC to DST.  Add null
+     terminator. */
+  while (*src != '/' && *src != '\0')
+    {
+      if (dst < part + NAME_MAX)
+        *dst++ = *src;
+      else
+        return -1;
+      src++;
+    }
+  *dst = '\0';
+
+  /* Advance source pointer. */
+  *srcp = src;
+  return 1;
+}
+
+/* Resolves PATH into the directory that holds its last
+   component, which is opened and stored in *DIRP, and the last
+   component itself, which is copied into NAME.  The path is
+   relative to the current thread's working directory unless it
+   starts with "/".  A path of "/" yields the root directory and
+   ".".
+   Returns true if successful.  Returns false if PATH is empty,
+   if a component is too long, or if a component other than the
+   last does not exist or is not a directory. */
+static bool
+resolve (const char *path, struct dir **dirp, char name[NAME_MAX + 1])
+{
+  struct dir *dir;
+  char part[NAME_MAX + 1];
+  int ok;
+
+  *dirp = NULL;
+  if (*path == '\0')
+    return false;
+  dir = *path == '/' ? dir_open_root () : open_cwd ();
+  if (dir == NULL)
+    return false;
+
+  ok = next_part (name, &path);
+  if (ok == 0)
+    strlcpy (name, ".", NAME_MAX + 1);
+  while (ok > 0 && (ok = next_part (part, &path)) > 0)
+    {
+      /* NAME is not the last component, so descend into it. */
+      struct inode *inode;
+
+      if (!dir_lookup (dir, name, &inode) || !inode_is_dir (inode))
+        {
+          inode_close (inode);
+          ok = -1;
+          break;
+        }
+      dir_close (dir);
+      dir = dir_open (inode);
+      if (dir == NULL)
+        return false;
+      strlcpy (name, part, NAME_MAX + 1);
+    }
+
+  if (ok < 0)
+    {
+      dir_close (dir);
+      return false;
+    }
+  *dirp = dir;
+  return true;
+}
+
 /* Creates a file named NAME with the given INITIAL_SIZE.
    Returns true if successful, false otherwise.
    Fails if a file named NAME already exists,
@@ -46,11 +169,34 @@ bool
 filesys_create (const char *name, off_t initial_size) 
 {
   block_sector_t inode_sector = 0;
-  struct dir *dir = dir_open_root ();
-  bool success = (dir != NULL
+  char base[NAME_MAX + 1];
+  struct dir *dir;
+  bool success = (resolve (name, &dir, base)
+                  && free_map_allocate (1, &inode_sector)
+                  && inode_create (inode_sector, initial_size, false)
+                  && dir_add (dir, base, inode_sector));
+  if (!success && inode_sector != 0) 
+    free_map_release (inode_sector, 1);
+  dir_close (dir);
+
+  return success;
+}
+
+/* Creates a directory named NAME.
+   Returns true if successful, false otherwise.
+   Fails if a file named NAME already exists,
+   or if internal memory allocation fails. */
+bool
+filesys_mkdir (const char *name) 
+{
+  block_sector_t inode_sector = 0;
+  char base[NAME_MAX + 1];
+  struct dir *dir;
+  bool success = (resolve (name, &dir, base)
                   && free_map_allocate (1, &inode_sector)
-                  && inode_create (inode_sector, initial_size)
-                  && dir_add (dir, name, inode_sector));
+                  && dir_create (inode_sector,
+                                 inode_get_inumber (dir_get_inode (dir)), 16)
+                  && dir_add (dir, base, inode_sector));
   if (!success && inode_sector != 0) 
     free_map_release (inode_sector, 1);
   dir_close (dir);
@@ -58,7 +204,7 @@ filesys_create (const char *name, off_t initial_size)
   return success;
 }
 
-/* Opens the file with the given NAME.
+/* Opens the file or directory with the given NAME.
    Returns the new file if successful or a null pointer
    otherwise.
    Fails if no file named NAME exists,
@@ -66,11 +212,12 @@ filesys_create (const char *name, off_t initial_size)
 struct file *
 filesys_open (const char *name)
 {
-  struct dir *dir = dir_open_root ();
+  char base[NAME_MAX + 1];
+  struct dir *dir;
   struct inode *inode = NULL;
 
-  if (dir != NULL)
-    dir_lookup (dir, name, &inode);
+  if (resolve (name, &dir, base))
+    dir_lookup (dir, base, &inode);
   dir_close (dir);
 
   return file_open (inode);
@@ -78,25 +225,54 @@ filesys_open (const char *name)
 
 /* Deletes the file named NAME.
    Returns true if successful, false on failure.
-   Fails if no file named NAME exists,
-   or if an internal memory allocation fails. */
+   Fails if no file named NAME exists, if NAME is a directory
+   that is not empty, or if an internal memory allocation
+   fails. */
 bool
 filesys_remove (const char *name) 
 {
-  struct dir *dir = dir_open_root ();
-  bool success = dir != NULL && dir_remove (dir, name);
+  char base[NAME_MAX + 1];
+  struct dir *dir;
+  bool success = resolve (name, &dir, base) && dir_remove (dir, base);
   dir_close (dir); 
 
   return success;
 }
-
+
+/* Changes the current thread's working directory to NAME.
+   Returns true if successful, false on failure. */
+bool
+filesys_chdir (const char *name) 
+{
+  char base[NAME_MAX + 1];
+  struct dir *dir;
+  struct inode *inode = NULL;
+  struct thread *t = thread_current ();
+
+  if (resolve (name, &dir, base))
+    dir_lookup (dir, base, &inode);
+  dir_close (dir);
+
+  if (inode == NULL || !inode_is_dir (inode))
+    {
+      inode_close (inode);
+      return false;
+    }
+  dir = dir_open (inode);
+  if (dir == NULL)
+    return false;
+  dir_close (t->cwd);
+  t->cwd = dir;
+  return true;
+}
+
 /* Formats the file system. */
 static void
 do_format (void)
 {
   printf ("Formatting file system...");
   free_map_create ();
-  if (!dir_create (ROOT_DIR_SECTOR, 16))
+  if (!dir_create (ROOT_DIR_SECTOR, ROOT_DIR_SECTOR, 16))
     PANIC ("root directory creation failed");
   free_map_close ();
   printf ("done.\n");
@@ -4,16 +4,28 @@
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct bitmap *reserved_map;  /* Reserved but unused sectors. */
+static size_t next_sector;           /* Where the next search starts. */
+static bool free_map_dirty;          /* Changed since last written? */
+static struct lock free_map_lock;    /* Protects all of the above. */
+
+static bool allocate (size_t cnt, block_sector_t *sectorp);
+static bool allocate_used (size_t cnt, block_sector_t *sectorp);
+static void write_free_map (void);
+static void set_reserved (bool value);
 
 /* Initializes the free map. */
 void
 free_map_init (void) 
 {
+  lock_init (&free_map_lock);
   free_map = bitmap_create (block_size (fs_device));
-  if (free_map == NULL)
+  reserved_map = bitmap_create (block_size (fs_device));
+  if (free_map == NULL || reserved_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
@@ -21,32 +33,164 @@ free_map_init (void)
 
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
+   Allocation is next fit: the search starts just past the
+   previous allocation and wraps around to sector 0 if nothing
+   fits beyond it.
+   The change reaches the free map file only when free_map_flush()
+   is next called.
+   If the sectors are not available, takes back the sectors that
+   open inodes have reserved but not used and tries again.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
-    {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
-    }
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector;
-  return sector != BITMAP_ERROR;
+  return (allocate_used (cnt, sectorp)
+          || (inode_reclaim_reservations ()
+              && allocate_used (cnt, sectorp)));
+}
+
+/* Reserves CNT consecutive sectors, like free_map_allocate(),
+   and stores the first into *SECTORP.  Reserved sectors are not
+   handed out to anyone else, but they are recorded as free in
+   the free map file until free_map_claim() is called for them,
+   so that a reservation still held at shutdown or at a crash
+   does not leak them.
+   Returns true if successful, false if not enough consecutive
+   sectors were available. */
+bool
+free_map_reserve (size_t cnt, block_sector_t *sectorp)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = allocate (cnt, sectorp);
+  if (success)
+    bitmap_set_multiple (reserved_map, *sectorp, cnt, true);
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Turns reserved SECTOR into an allocated sector, which the free
+   map file then records as in use. */
+void
+free_map_claim (block_sector_t sector)
+{
+  lock_acquire (&free_map_lock);
+  ASSERT (bitmap_test (reserved_map, sector));
+  bitmap_reset (reserved_map, sector);
+  free_map_dirty = true;
+  lock_release (&free_map_lock);
+}
+
+/* Makes CNT reserved sectors starting at SECTOR available for
+   use again. */
+void
+free_map_unreserve (block_sector_t sector, size_t cnt)
+{
+  lock_acquire (&free_map_lock);
+  ASSERT (bitmap_all (reserved_map, sector, cnt));
+  bitmap_set_multiple (reserved_map, sector, cnt, false);
+  bitmap_set_multiple (free_map, sector, cnt, false);
+  lock_release (&free_map_lock);
+}
+
+/* Marks CNT consecutive free sectors as used, next fit, and
+   stores the first into *SECTORP.  Returns true if successful.
+   The caller must hold free_map_lock. */
+static bool
+allocate (size_t cnt, block_sector_t *sectorp)
+{
+  block_sector_t sector;
+
+  sector = bitmap_scan_and_flip (free_map, next_sector, cnt, false);
+  if (sector == BITMAP_ERROR && next_sector != 0)
+    sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
+  if (sector == BITMAP_ERROR)
+    return false;
+  *sectorp = sector;
+  next_sector = sector + cnt;
+  return true;
+}
+
+/* Allocates CNT consecutive sectors, like allocate(), and marks
+   the free map as changed.  Returns true if successful. */
+static bool
+allocate_used (size_t cnt, block_sector_t *sectorp)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = allocate (cnt, sectorp);
+  if (success)
+    free_map_dirty = true;
+  lock_release (&free_map_lock);
+  return success;
 }
 
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
   bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  free_map_dirty = true;
+  lock_release (&free_map_lock);
+}
+
+/* Writes the free map to its file if it has changed since it
+   was last written.  The file's sectors then reach the disk
+   along with the rest of the buffer cache. */
+void
+free_map_flush (void)
+{
+  lock_acquire (&free_map_lock);
+  write_free_map ();
+  lock_release (&free_map_lock);
+}
+
+/* Writes the free map to its file if it is open and has changed
+   since it was last written.  Reserved sectors are written as
+   free.  The caller must hold free_map_lock. */
+static void
+write_free_map (void)
+{
+  ASSERT (lock_held_by_current_thread (&free_map_lock));
+  if (free_map_dirty && free_map_file != NULL)
+    {
+      bool success;
+
+      set_reserved (false);
+      success = bitmap_write (free_map, free_map_file);
+      set_reserved (true);
+      if (!success)
+        PANIC ("can't write free map");
+      free_map_dirty = false;
+    }
+}
+
+/* Sets the bits in the free map for every reserved sector to
+   VALUE.  The caller must hold free_map_lock. */
+static void
+set_reserved (bool value)
+{
+  size_t start = 0;
+  size_t end = bitmap_size (reserved_map);
+
+  while (start < end)
+    {
+      size_t cnt;
+
+      start = bitmap_scan (reserved_map, start, 1, true);
+      if (start == BITMAP_ERROR)
+        break;
+      for (cnt = 1; start + cnt < end; cnt++)
+        if (!bitmap_test (reserved_map, start + cnt))
+          break;
+      bitmap_set_multiple (free_map, start, cnt, value);
+      start += cnt;
+    }
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -60,11 +204,17 @@ free_map_open (void)
     PANIC ("can't read free map");
 }
 
-/* Writes the free map to disk and closes the free map file. */
+/* Writes the free map to disk and closes the free map file.
+   Both happen under free_map_lock, so that the periodic flusher
+   cannot write to the file after it has been closed. */
 void
 free_map_close (void) 
 {
+  lock_acquire (&free_map_lock);
+  write_free_map ();
   file_close (free_map_file);
+  free_map_file = NULL;
+  lock_release (&free_map_lock);
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -73,7 +223,7 @@ void
 free_map_create (void) 
 {
   /* Create inode. */
-  if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map)))
+  if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map), false))
     PANIC ("free map creation failed");
 
   /* Write bitmap to file. */
@@ -82,4 +232,5 @@ free_map_create (void)
     PANIC ("can't open free map");
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
+  free_map_dirty = false;
 }
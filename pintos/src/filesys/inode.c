@@ -1,143 +1,285 @@
 #include "filesys/inode.h"
-#include <list.h>
+#include <hash.h>
 #include <debug.h>
+#include <list.h>
 #include <round.h>
 #include <string.h>
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Number of direct sector pointers in an inode, enough to make
+   struct inode_disk fill a metadata sector. */
+#define DIRECT_CNT (META_SECTOR_SIZE / sizeof (block_sector_t) - 5)
+
+/* Minimum number of contiguous data sectors reserved at a time
+   for a growing file. */
+#define RESERVE_MIN 16
+
+/* Maximum number of contiguous data sectors reserved at a time. */
+#define RESERVE_MAX 256
+
+/* Number of sector pointers in an index block. */
+#define PTRS_PER_SECTOR (META_SECTOR_SIZE / sizeof (block_sector_t))
+
 /* On-disk inode.
-   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+   Must be exactly META_SECTOR_SIZE bytes long.
+
+   The first DIRECT_CNT data sectors are listed in the inode
+   itself, the next PTRS_PER_SECTOR in the indirect block, and
+   the rest in the index blocks listed by the doubly indirect
+   block.  A sector number of 0 means that the sector (or index
+   block) has not been allocated; sector 0 holds the free map, so
+   it never belongs to a file.
+
+   Inodes and index blocks are metadata sectors, accessed with
+   cache_read_meta() and cache_write_meta().  So are the data
+   sectors of directories and of the free map, each of which
+   holds META_SECTOR_SIZE bytes of the file's data instead of
+   BLOCK_SECTOR_SIZE. */
 struct inode_disk
   {
-    block_sector_t start;               /* First data sector. */
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
-    uint32_t unused[125];               /* Not used. */
+    uint32_t is_dir;                    /* 1 if a directory, 0 if not. */
+    block_sector_t direct[DIRECT_CNT];  /* Direct data sectors. */
+    block_sector_t indirect;            /* Indirect index block. */
+    block_sector_t doubly_indirect;     /* Doubly indirect index block. */
   };
 
-/* Returns the number of sectors to allocate for an inode SIZE
-   bytes long. */
-static inline size_t
-bytes_to_sectors (off_t size)
-{
-  return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
-}
-
-/* In-memory inode. */
+/* In-memory inode.
+
+   Locking: open_cnt and loading are protected by
+   open_inodes_lock.  RW protects the file's length and
+   deny_write_cnt.  Reading or writing existing data holds it for
+   reading, so any number of readers and writers can run at once;
+   it is held for writing only while those members change.
+   EXTEND_LOCK serializes writes that extend the file, with each
+   other and with inode_deny_write().  Such a write allocates the
+   new sectors and fills them with data before it takes RW for
+   writing to publish the new length, so readers do not wait for
+   the allocation or the data transfer.  INDEX_LOCK protects the
+   sector pointers in DATA and the cached index blocks.  It is
+   held for one sector lookup or allocation at a time.  The
+   reservation is protected by the global reserve_lock, so that
+   any thread can take it back when the disk fills up.  DIR_LOCK
+   is not used by this file; directory.c holds it while it
+   searches or changes a directory's entries. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open_inodes. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
+    bool loading;                       /* DATA not yet read from disk? */
+    struct condition loaded;            /* Signaled when DATA is read. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
     struct inode_disk data;             /* Inode content. */
+    struct rwlock rw;                   /* Protects length, deny_write_cnt. */
+    struct lock extend_lock;            /* Held while extending. */
+    struct lock index_lock;             /* Protects sector lookups. */
+    struct lock dir_lock;               /* Serializes directory ops. */
+
+    /* Copies of the index blocks most recently used, one for
+       each level of the index, so that sequential access does
+       not look up the same blocks in the buffer cache over and
+       over.  Level 0 holds an index block that lists data
+       sectors, level 1 the doubly indirect block. */
+    block_sector_t index_sector[2];     /* Index blocks cached, or 0. */
+    block_sector_t index[2][PTRS_PER_SECTOR]; /* Their contents. */
+
+    /* Run of free sectors set aside for this inode's data, so
+       that a file that grows a little at a time still ends up in
+       long contiguous extents even when other files are growing
+       at the same time.  Returned to the free map when the inode
+       is closed, or earlier if the free map runs out of other
+       free sectors.  The free map file records these sectors as
+       free until they are used (see free_map_reserve()). */
+    block_sector_t reserve_start;       /* First reserved sector. */
+    size_t reserve_cnt;                 /* Number of reserved sectors. */
+    struct list_elem reserve_elem;      /* In reserving_inodes. */
   };
 
+/* Returns true if INODE's data sectors are metadata sectors,
+   that is, if INODE is a directory or the free map. */
+static inline bool
+is_metadata (const struct inode *inode)
+{
+  return inode->data.is_dir || inode->sector == FREE_MAP_SECTOR;
+}
+
+/* Returns the number of bytes of data in each of INODE's data
+   sectors. */
+static inline off_t
+sector_size (const struct inode *inode)
+{
+  return is_metadata (inode) ? META_SECTOR_SIZE : BLOCK_SECTOR_SIZE;
+}
+
+/* Returns the number of sectors to allocate for INODE to hold
+   SIZE bytes. */
+static inline size_t
+bytes_to_sectors (const struct inode *inode, off_t size)
+{
+  return DIV_ROUND_UP (size, sector_size (inode));
+}
+
+/* A sector's worth of zeros, for initializing new sectors. */
+static char zeros[BLOCK_SECTOR_SIZE];
+
+static block_sector_t get_sector (struct inode *, size_t idx, bool create);
+static off_t extend (struct inode *, off_t length);
+static void unreserve (struct inode *);
+static void deallocate (struct inode *);
+
 /* Returns the block device sector that contains byte offset POS
-   within INODE.
+   within INODE, whose length is taken to be LENGTH.
    Returns -1 if INODE does not contain data for a byte at offset
    POS. */
 static block_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) 
+byte_to_sector (struct inode *inode, off_t pos, off_t length) 
 {
+  block_sector_t sector;
+
   ASSERT (inode != NULL);
-  if (pos < inode->data.length)
-    return inode->data.start + pos / BLOCK_SECTOR_SIZE;
-  else
+  if (pos >= length)
     return -1;
+
+  lock_acquire (&inode->index_lock);
+  sector = get_sector (inode, pos / sector_size (inode), false);
+  lock_release (&inode->index_lock);
+  return sector;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Open inodes, keyed by sector, so that opening a single inode
+   twice returns the same `struct inode'. */
+static struct hash open_inodes;
+
+/* Protects open_inodes and the open_cnt member of every inode in
+   it. */
+static struct lock open_inodes_lock;
+
+static hash_hash_func inode_hash;
+static hash_less_func inode_less;
+
+/* Inodes that hold a reservation (reserve_cnt > 0). */
+static struct list reserving_inodes;
+
+/* Protects reserving_inodes and the reserve_start and
+   reserve_cnt members of every inode. */
+static struct lock reserve_lock;
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  lock_init (&open_inodes_lock);
+  list_init (&reserving_inodes);
+  lock_init (&reserve_lock);
+  if (!hash_init (&open_inodes, inode_hash, inode_less, NULL))
+    PANIC ("inode: hash table creation failed");
 }
 
 /* Initializes an inode with LENGTH bytes of data and
    writes the new inode to sector SECTOR on the file system
-   device.
+   device.  The inode is for a directory if IS_DIR is true.
    Returns true if successful.
    Returns false if memory or disk allocation fails. */
 bool
-inode_create (block_sector_t sector, off_t length)
+inode_create (block_sector_t sector, off_t length, bool is_dir)
 {
-  struct inode_disk *disk_inode = NULL;
-  bool success = false;
+  struct inode *inode;
+  bool success;
 
   ASSERT (length >= 0);
 
   /* If this assertion fails, the inode structure is not exactly
-     one sector in size, and you should fix that. */
-  ASSERT (sizeof *disk_inode == BLOCK_SECTOR_SIZE);
+     one metadata sector in size, and you should fix that. */
+  ASSERT (sizeof (struct inode_disk) == META_SECTOR_SIZE);
 
-  disk_inode = calloc (1, sizeof *disk_inode);
-  if (disk_inode != NULL)
-    {
-      size_t sectors = bytes_to_sectors (length);
-      disk_inode->length = length;
-      disk_inode->magic = INODE_MAGIC;
-      if (free_map_allocate (sectors, &disk_inode->start)) 
-        {
-          block_write (fs_device, sector, disk_inode);
-          if (sectors > 0) 
-            {
-              static char zeros[BLOCK_SECTOR_SIZE];
-              size_t i;
-              
-              for (i = 0; i < sectors; i++) 
-                block_write (fs_device, disk_inode->start + i, zeros);
-            }
-          success = true; 
-        } 
-      free (disk_inode);
-    }
+  /* Build the inode in memory, then let extend() allocate its
+     data and write it out. */
+  inode = calloc (1, sizeof *inode);
+  if (inode == NULL)
+    return false;
+  inode->sector = sector;
+  inode->data.magic = INODE_MAGIC;
+  inode->data.is_dir = is_dir;
+  lock_init (&inode->index_lock);
+  inode->data.length = extend (inode, length);
+  success = inode->data.length == length;
+  cache_write_meta (sector, &inode->data, 0, META_SECTOR_SIZE);
+  unreserve (inode);
+  if (!success)
+    deallocate (inode);
+  free (inode);
   return success;
 }
 
 /* Reads an inode from SECTOR
    and returns a `struct inode' that contains it.
-   Returns a null pointer if memory allocation fails. */
+   Returns a null pointer if memory allocation fails.
+
+   The inode is added to open_inodes, marked as loading, before
+   it is read, and open_inodes_lock is not held during the read.
+   Anyone else who opens the inode meanwhile waits for the read
+   to finish. */
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
+  struct inode key;
+  struct hash_elem *e;
   struct inode *inode;
 
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
+  lock_acquire (&open_inodes_lock);
+  key.sector = sector;
+  e = hash_find (&open_inodes, &key.elem);
+  if (e != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
-        {
-          inode_reopen (inode);
-          return inode; 
-        }
+      inode = hash_entry (e, struct inode, elem);
+      inode->open_cnt++;
+      while (inode->loading)
+        cond_wait (&inode->loaded, &open_inodes_lock);
+      lock_release (&open_inodes_lock);
+      return inode; 
     }
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
-    return NULL;
+    {
+      lock_release (&open_inodes_lock);
+      return NULL;
+    }
 
   /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
   inode->sector = sector;
   inode->open_cnt = 1;
+  inode->loading = true;
+  cond_init (&inode->loaded);
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  block_read (fs_device, inode->sector, &inode->data);
+  inode->index_sector[0] = inode->index_sector[1] = 0;
+  inode->reserve_cnt = 0;
+  rwlock_init (&inode->rw);
+  lock_init (&inode->extend_lock);
+  lock_init (&inode->index_lock);
+  lock_init (&inode->dir_lock);
+  hash_insert (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+
+  /* Read the inode, then let any waiting openers have it. */
+  cache_read_meta (inode->sector, &inode->data, 0, META_SECTOR_SIZE);
+  lock_acquire (&open_inodes_lock);
+  inode->loading = false;
+  cond_broadcast (&inode->loaded, &open_inodes_lock);
+  lock_release (&open_inodes_lock);
   return inode;
 }
 
@@ -146,7 +288,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+    }
   return inode;
 }
 
@@ -163,22 +309,29 @@ inode_get_inumber (const struct inode *inode)
 void
 inode_close (struct inode *inode) 
 {
+  bool last;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
 
-  /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  /* Release resources if this was the last opener.  Once the
+     inode is out of open_inodes nobody else can reach it, so the
+     rest needs no lock. */
+  lock_acquire (&open_inodes_lock);
+  last = --inode->open_cnt == 0;
+  if (last)
+    hash_delete (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+
+  if (last)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
- 
       /* Deallocate blocks if removed. */
+      unreserve (inode);
       if (inode->removed) 
         {
           free_map_release (inode->sector, 1);
-          free_map_release (inode->data.start,
-                            bytes_to_sectors (inode->data.length)); 
+          deallocate (inode);
         }
 
       free (inode); 
@@ -202,17 +355,20 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
+  off_t length;
+  off_t size_per_sector = sector_size (inode);
 
+  rwlock_acquire_read (&inode->rw);
+  length = inode->data.length;
   while (size > 0) 
     {
       /* Disk sector to read, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
-      int sector_ofs = offset % BLOCK_SECTOR_SIZE;
+      block_sector_t sector_idx = byte_to_sector (inode, offset, length);
+      int sector_ofs = offset % size_per_sector;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
-      int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
+      off_t inode_left = length - offset;
+      int sector_left = size_per_sector - sector_ofs;
       int min_left = inode_left < sector_left ? inode_left : sector_left;
 
       /* Number of bytes to actually copy out of this sector. */
@@ -220,60 +376,58 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Read full sector directly into caller's buffer. */
-          block_read (fs_device, sector_idx, buffer + bytes_read);
-        }
-      else 
-        {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-          block_read (fs_device, sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-        }
+      if (is_metadata (inode))
+        cache_read_meta (sector_idx, buffer + bytes_read, sector_ofs,
+                         chunk_size);
+      else
+        cache_read (sector_idx, buffer + bytes_read, sector_ofs, chunk_size);
       
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  free (bounce);
+  rwlock_release_read (&inode->rw);
 
   return bytes_read;
 }
 
-/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
-   Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
-off_t
-inode_write_at (struct inode *inode, const void *buffer_, off_t size,
-                off_t offset) 
+/* Queues the sectors of INODE that hold bytes START up to END
+   to be read into the buffer cache in the background.  Sectors
+   past the end of INODE are ignored. */
+void
+inode_read_ahead (struct inode *inode, off_t start, off_t end) 
 {
-  const uint8_t *buffer = buffer_;
-  off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
+  off_t length = inode_length (inode);
+  off_t size_per_sector = sector_size (inode);
+  off_t pos;
+
+  if (end > length)
+    end = length;
+  for (pos = ROUND_DOWN (start, size_per_sector); pos < end;
+       pos += size_per_sector)
+    cache_readahead (byte_to_sector (inode, pos, length));
+}
 
-  if (inode->deny_write_cnt)
-    return 0;
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET,
+   treating LENGTH as INODE's length.  Returns the number of
+   bytes written. */
+static off_t
+write_data (struct inode *inode, const uint8_t *buffer, off_t size,
+            off_t offset, off_t length)
+{
+  off_t bytes_written = 0;
+  off_t size_per_sector = sector_size (inode);
 
   while (size > 0) 
     {
       /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
-      int sector_ofs = offset % BLOCK_SECTOR_SIZE;
+      block_sector_t sector_idx = byte_to_sector (inode, offset, length);
+      int sector_ofs = offset % size_per_sector;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
-      int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
+      off_t inode_left = length - offset;
+      int sector_left = size_per_sector - sector_ofs;
       int min_left = inode_left < sector_left ? inode_left : sector_left;
 
       /* Number of bytes to actually write into this sector. */
@@ -281,49 +435,95 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Write full sector directly to disk. */
-          block_write (fs_device, sector_idx, buffer + bytes_written);
-        }
-      else 
-        {
-          /* We need a bounce buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left) 
-            block_read (fs_device, sector_idx, bounce);
-          else
-            memset (bounce, 0, BLOCK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          block_write (fs_device, sector_idx, bounce);
-        }
+      if (is_metadata (inode))
+        cache_write_meta (sector_idx, buffer + bytes_written, sector_ofs,
+                          chunk_size);
+      else
+        cache_write (sector_idx, buffer + bytes_written, sector_ofs,
+                     chunk_size);
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
     }
-  free (bounce);
+
+  return bytes_written;
+}
+
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
+   Writing past end of file extends INODE, filling any gap with
+   zeros.
+   Returns the number of bytes actually written, which may be
+   less than SIZE if the disk fills up or an error occurs. */
+off_t
+inode_write_at (struct inode *inode, const void *buffer_, off_t size,
+                off_t offset) 
+{
+  const uint8_t *buffer = buffer_;
+  off_t bytes_written = 0;
+  off_t length, new_length;
+  bool denied;
+
+  /* Overwriting existing data needs RW only for reading. */
+  rwlock_acquire_read (&inode->rw);
+  if (inode->deny_write_cnt)
+    {
+      rwlock_release_read (&inode->rw);
+      return 0;
+    }
+  length = inode->data.length;
+  if (offset + size <= length) 
+    {
+      bytes_written = write_data (inode, buffer, size, offset, length);
+      rwlock_release_read (&inode->rw);
+      return bytes_written;
+    }
+  rwlock_release_read (&inode->rw);
+
+  /* Extending.  Only one thread at a time may do so, but readers
+     of the existing data carry on meanwhile, since they cannot
+     see past the old length.  inode_deny_write() also takes
+     EXTEND_LOCK, so writes cannot be denied between the check
+     here and publishing the new length.  If the disk is full,
+     extend() grows INODE as far as it can and we write only that
+     much. */
+  lock_acquire (&inode->extend_lock);
+  rwlock_acquire_read (&inode->rw);
+  denied = inode->deny_write_cnt > 0;
+  rwlock_release_read (&inode->rw);
+  if (denied)
+    {
+      lock_release (&inode->extend_lock);
+      return 0;
+    }
+  new_length = extend (inode, offset + size);
+  bytes_written = write_data (inode, buffer, size, offset, new_length);
+
+  rwlock_acquire_write (&inode->rw);
+  if (new_length > inode->data.length)
+    {
+      inode->data.length = new_length;
+      cache_write_meta (inode->sector, &inode->data, 0, META_SECTOR_SIZE);
+    }
+  rwlock_release_write (&inode->rw);
+  lock_release (&inode->extend_lock);
 
   return bytes_written;
 }
 
 /* Disables writes to INODE.
-   May be called at most once per inode opener. */
+   May be called at most once per inode opener.
+   Waits for any write that is extending INODE to finish. */
 void
 inode_deny_write (struct inode *inode) 
 {
+  lock_acquire (&inode->extend_lock);
+  rwlock_acquire_write (&inode->rw);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+  rwlock_release_write (&inode->rw);
+  lock_release (&inode->extend_lock);
 }
 
 /* Re-enables writes to INODE.
@@ -332,9 +532,39 @@ inode_deny_write (struct inode *inode)
 void
 inode_allow_write (struct inode *inode) 
 {
+  rwlock_acquire_write (&inode->rw);
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
+  rwlock_release_write (&inode->rw);
+}
+
+/* Returns true if INODE is a directory, false otherwise. */
+bool
+inode_is_dir (const struct inode *inode)
+{
+  return inode->data.is_dir != 0;
+}
+
+/* Returns true if INODE has been removed, false otherwise. */
+bool
+inode_is_removed (const struct inode *inode)
+{
+  return inode->removed;
+}
+
+/* Acquires INODE's directory lock.  See struct inode. */
+void
+inode_lock_dir (struct inode *inode)
+{
+  lock_acquire (&inode->dir_lock);
+}
+
+/* Releases INODE's directory lock. */
+void
+inode_unlock_dir (struct inode *inode)
+{
+  lock_release (&inode->dir_lock);
 }
 
 /* Returns the length, in bytes, of INODE's data. */
@@ -343,3 +573,315 @@ inode_length (const struct inode *inode)
 {
   return inode->data.length;
 }
+
+/* Returns a hash value for inode E. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct inode *inode = hash_entry (e, struct inode, elem);
+  return hash_int (inode->sector);
+}
+
+/* Returns true if inode A precedes inode B. */
+static bool
+inode_less (const struct hash_elem *a_, const struct hash_elem *b_,
+            void *aux UNUSED)
+{
+  const struct inode *a = hash_entry (a_, struct inode, elem);
+  const struct inode *b = hash_entry (b_, struct inode, elem);
+  return a->sector < b->sector;
+}
+
+/* Allocates an index block, fills it with zeros, and stores its
+   number in *SECTORP.  Returns false if the disk is full. */
+static bool
+allocate_zeroed (block_sector_t *sectorp)
+{
+  if (!free_map_allocate (1, sectorp))
+    return false;
+  cache_write_meta (*sectorp, zeros, 0, META_SECTOR_SIZE);
+  return true;
+}
+
+/* Returns INODE's unused reserved sectors to the free map.
+   The caller must hold reserve_lock. */
+static void
+drop_reservation (struct inode *inode)
+{
+  ASSERT (lock_held_by_current_thread (&reserve_lock));
+  if (inode->reserve_cnt > 0)
+    {
+      free_map_unreserve (inode->reserve_start, inode->reserve_cnt);
+      inode->reserve_cnt = 0;
+      list_remove (&inode->reserve_elem);
+    }
+}
+
+/* Returns every inode's unused reserved sectors to the free map.
+   Returns true if there were any.  The caller must hold
+   reserve_lock. */
+static bool
+drop_all_reservations (void)
+{
+  bool dropped = !list_empty (&reserving_inodes);
+
+  while (!list_empty (&reserving_inodes))
+    drop_reservation (list_entry (list_front (&reserving_inodes),
+                                  struct inode, reserve_elem));
+  return dropped;
+}
+
+/* Takes back the sectors reserved by every open inode but not
+   yet used, so that they can be allocated to anyone.  Returns
+   true if there were any.  The free map calls this before it
+   reports the disk full. */
+bool
+inode_reclaim_reservations (void)
+{
+  bool reclaimed;
+
+  lock_acquire (&reserve_lock);
+  reclaimed = drop_all_reservations ();
+  lock_release (&reserve_lock);
+  return reclaimed;
+}
+
+/* Reserves a run of CNT contiguous free sectors for INODE, or
+   the longest shorter run that is free, halving CNT each time.
+   Returns false if not even one sector is free.  The caller
+   must hold reserve_lock, and INODE must hold no reservation. */
+static bool
+try_reserve (struct inode *inode, size_t cnt)
+{
+  for (; cnt > 0; cnt /= 2)
+    if (free_map_reserve (cnt, &inode->reserve_start))
+      {
+        inode->reserve_cnt = cnt;
+        list_push_back (&reserving_inodes, &inode->reserve_elem);
+        return true;
+      }
+  return false;
+}
+
+/* Sets aside a run of at least CNT contiguous free sectors (but
+   no fewer than RESERVE_MIN) for INODE's data, replacing any
+   previous reservation.  If no such run is free, tries shorter
+   ones, and if no sector at all is free, takes back the other
+   inodes' reservations and tries again.  Returns false if the
+   disk is full.  The caller must hold reserve_lock. */
+static bool
+reserve (struct inode *inode, size_t cnt)
+{
+  drop_reservation (inode);
+
+  if (cnt < RESERVE_MIN)
+    cnt = RESERVE_MIN;
+  if (cnt > RESERVE_MAX)
+    cnt = RESERVE_MAX;
+  if (try_reserve (inode, cnt))
+    return true;
+  return drop_all_reservations () && try_reserve (inode, cnt);
+}
+
+/* Returns INODE's unused reserved sectors to the free map. */
+static void
+unreserve (struct inode *inode)
+{
+  lock_acquire (&reserve_lock);
+  drop_reservation (inode);
+  lock_release (&reserve_lock);
+}
+
+/* Allocates a data sector for INODE from its reservation,
+   reserving more if necessary, fills it with zeros, and stores
+   its number in *SECTORP.  Returns false if the disk is full. */
+static bool
+allocate_data (struct inode *inode, block_sector_t *sectorp)
+{
+  lock_acquire (&reserve_lock);
+  if (inode->reserve_cnt == 0 && !reserve (inode, RESERVE_MIN))
+    {
+      lock_release (&reserve_lock);
+      return false;
+    }
+  *sectorp = inode->reserve_start++;
+  if (--inode->reserve_cnt == 0)
+    list_remove (&inode->reserve_elem);
+  free_map_claim (*sectorp);
+  lock_release (&reserve_lock);
+
+  if (is_metadata (inode))
+    cache_write_meta (*sectorp, zeros, 0, META_SECTOR_SIZE);
+  else
+    cache_write (*sectorp, zeros, 0, BLOCK_SECTOR_SIZE);
+  return true;
+}
+
+/* Returns the sector number in slot SLOT of INODE's index block
+   SECTOR.  If the slot is empty and CREATE is true, first
+   allocates a zeroed sector and stores it in the slot: a data
+   sector if DATA is true, otherwise an index block.  Returns 0
+   if the slot is empty and remains so. */
+static block_sector_t
+get_slot (struct inode *inode, block_sector_t sector, size_t slot,
+          bool create, bool data)
+{
+  int level = data ? 0 : 1;
+  block_sector_t *index = inode->index[level];
+
+  ASSERT (sector != 0);
+  ASSERT (slot < PTRS_PER_SECTOR);
+
+  if (inode->index_sector[level] != sector)
+    {
+      cache_read_meta (sector, index, 0, sizeof inode->index[level]);
+      inode->index_sector[level] = sector;
+    }
+
+  if (index[slot] == 0 && create)
+    {
+      block_sector_t new;
+
+      if (data ? !allocate_data (inode, &new) : !allocate_zeroed (&new))
+        return 0;
+      index[slot] = new;
+      cache_write_meta (sector, &new, slot * sizeof new, sizeof new);
+    }
+  return index[slot];
+}
+
+/* Makes sure that *SECTORP, a pointer to an index block in an
+   on-disk inode, refers to an allocated block.  Returns
+   false if it does not and cannot be allocated (or CREATE is
+   false).  The caller is responsible for writing the inode. */
+static bool
+get_root (block_sector_t *sectorp, bool create)
+{
+  if (*sectorp == 0)
+    return create && allocate_zeroed (sectorp);
+  return true;
+}
+
+/* Returns the sector that holds sector IDX of INODE's data.
+   If it has not been allocated and CREATE is true, allocates it
+   and fills it with zeros.  Returns 0 if the sector is not (and
+   could not be) allocated. */
+static block_sector_t
+get_sector (struct inode *inode, size_t idx, bool create)
+{
+  struct inode_disk *d = &inode->data;
+
+  if (idx < DIRECT_CNT)
+    {
+      if (d->direct[idx] == 0 && create
+          && !allocate_data (inode, &d->direct[idx]))
+        return 0;
+      return d->direct[idx];
+    }
+  idx -= DIRECT_CNT;
+
+  if (idx < PTRS_PER_SECTOR)
+    {
+      if (!get_root (&d->indirect, create))
+        return 0;
+      return get_slot (inode, d->indirect, idx, create, true);
+    }
+  idx -= PTRS_PER_SECTOR;
+
+  if (idx < PTRS_PER_SECTOR * PTRS_PER_SECTOR)
+    {
+      block_sector_t index;
+
+      if (!get_root (&d->doubly_indirect, create))
+        return 0;
+      index = get_slot (inode, d->doubly_indirect, idx / PTRS_PER_SECTOR,
+                        create, false);
+      if (index == 0)
+        return 0;
+      return get_slot (inode, index, idx % PTRS_PER_SECTOR, create, true);
+    }
+
+  return 0;
+}
+
+/* Allocates zeroed sectors so that INODE can hold LENGTH bytes,
+   without changing its length.  If the disk fills up, allocates
+   only as many as possible.  Returns the length that INODE can
+   now hold, which is LENGTH unless the disk filled up.
+   The new data sectors are taken from a single contiguous run if
+   one is free, so that large files are laid out in a few long
+   extents. */
+static off_t
+extend (struct inode *inode, off_t length)
+{
+  size_t sector_cnt = bytes_to_sectors (inode, length);
+  size_t idx = bytes_to_sectors (inode, inode->data.length);
+
+  if (length <= inode->data.length)
+    return inode->data.length;
+
+  lock_acquire (&reserve_lock);
+  if (sector_cnt - idx > inode->reserve_cnt)
+    reserve (inode, sector_cnt - idx);
+  lock_release (&reserve_lock);
+  for (; idx < sector_cnt; idx++)
+    {
+      block_sector_t sector;
+
+      /* INDEX_LOCK is taken for one sector at a time, so that
+         readers looking up existing sectors wait for at most
+         one allocation. */
+      lock_acquire (&inode->index_lock);
+      sector = get_sector (inode, idx, true);
+      lock_release (&inode->index_lock);
+      if (sector == 0)
+        {
+          length = idx * sector_size (inode);
+          break;
+        }
+    }
+
+  return length;
+}
+
+/* Releases every sector in INODE's index block SECTOR, which
+   lists data sectors if LEVEL is 0 or further index blocks if
+   LEVEL is 1, and then SECTOR itself.  The block is read into
+   INODE's cached copy for LEVEL, which keeps these buffers off
+   the kernel stack. */
+static void
+deallocate_index (struct inode *inode, block_sector_t sector, int level)
+{
+  block_sector_t *index = inode->index[level];
+  size_t i;
+
+  cache_read_meta (sector, index, 0, sizeof inode->index[level]);
+  inode->index_sector[level] = 0;
+  for (i = 0; i < PTRS_PER_SECTOR; i++)
+    if (index[i] != 0)
+      {
+        if (level > 0)
+          deallocate_index (inode, index[i], level - 1);
+        else
+          free_map_release (index[i], 1);
+      }
+  free_map_release (sector, 1);
+}
+
+/* Releases all of INODE's data sectors and index blocks.
+   Sectors are released even if they lie past the end of the
+   file, because a failed extension may leave some behind. */
+static void
+deallocate (struct inode *inode)
+{
+  struct inode_disk *d = &inode->data;
+  size_t i;
+
+  for (i = 0; i < DIRECT_CNT; i++)
+    if (d->direct[i] != 0)
+      free_map_release (d->direct[i], 1);
+  if (d->indirect != 0)
+    deallocate_index (inode, d->indirect, 0);
+  if (d->doubly_indirect != 0)
+    deallocate_index (inode, d->doubly_indirect, 1);
+}
@@ -3,6 +3,7 @@
 #include <limits.h>
 #include <round.h>
 #include <stdio.h>
+#include "threads/interrupt.h"
 #include "threads/malloc.h"
 #ifdef FILESYS
 #include "filesys/file.h"
@@ -23,11 +24,18 @@ typedef unsigned long elem_type;
 
 /* From the outside, a bitmap is an array of bits.  From the
    inside, it's an array of elem_type (defined above) that
-   simulates an array of bits. */
+   simulates an array of bits.
+
+   A second, smaller array summarizes the first: bit K of `full'
+   is set if and only if element K of `bits' has every bit set.
+   Searches for false bits use it to step over a whole summary
+   element's worth of full elements (1,024 bits) at a time, so
+   finding free space in a mostly-allocated map is cheap. */
 struct bitmap
   {
     size_t bit_cnt;     /* Number of bits. */
     elem_type *bits;    /* Elements that represent bits. */
+    elem_type *full;    /* One bit per element of BITS: all ones? */
   };
 
 /* Returns the index of the element that contains the bit
@@ -69,6 +77,140 @@ last_mask (const struct bitmap *b)
   return last_bits ? ((elem_type) 1 << last_bits) - 1 : (elem_type) -1;
 }
 
+/* Returns the number of bytes required for BIT_CNT bits plus the
+   summary of those bits. */
+static inline size_t
+buf_byte_cnt (size_t bit_cnt)
+{
+  return byte_cnt (bit_cnt) + byte_cnt (elem_cnt (bit_cnt));
+}
+
+/* Brings the summary bit for element IDX of B up to date.
+   Interrupts are disabled so that the element's value and the
+   summary bit written for it cannot be separated by a change
+   made by another thread. */
+static inline void
+update_summary (struct bitmap *b, size_t idx) 
+{
+  enum intr_level old_level = intr_disable ();
+  if (b->bits[idx] == (elem_type) -1)
+    b->full[elem_idx (idx)] |= bit_mask (idx);
+  else
+    b->full[elem_idx (idx)] &= ~bit_mask (idx);
+  intr_set_level (old_level);
+}
+
+/* Recomputes the whole summary of B from its bits. */
+static void
+rebuild_summary (struct bitmap *b) 
+{
+  size_t i;
+
+  for (i = 0; i < elem_cnt (elem_cnt (b->bit_cnt)); i++)
+    b->full[i] = 0;
+  for (i = 0; i < elem_cnt (b->bit_cnt); i++)
+    if (b->bits[i] == (elem_type) -1)
+      b->full[elem_idx (i)] |= bit_mask (i);
+}
+
+/* Returns the index of the first element of B at or after IDX
+   and before LIMIT that is not full, or LIMIT if all of them
+   are. */
+static size_t
+next_nonfull_elem (const struct bitmap *b, size_t idx, size_t limit) 
+{
+  size_t sidx;
+  elem_type nonfull;
+
+  if (idx >= limit)
+    return limit;
+
+  sidx = elem_idx (idx);
+  nonfull = ~b->full[sidx] & ((elem_type) -1 << (idx % ELEM_BITS));
+  while (nonfull == 0) 
+    {
+      if (++sidx >= elem_cnt (limit))
+        return limit;
+      nonfull = ~b->full[sidx];
+    }
+
+  idx = sidx * ELEM_BITS + __builtin_ctzl (nonfull);
+  return idx < limit ? idx : limit;
+}
+
+/* Returns a mask with the bits of an element that fall within
+   the bit range [START, END) turned on, where START and END are
+   bit offsets within that element (0 <= START < END <=
+   ELEM_BITS). */
+static inline elem_type
+range_mask (size_t start, size_t end) 
+{
+  elem_type mask = (elem_type) -1 << start;
+  if (end < ELEM_BITS)
+    mask &= ((elem_type) 1 << end) - 1;
+  return mask;
+}
+
+/* Returns element number ELEM_IDX of B, complemented if VALUE is
+   false, so that 1-bits in the result are bits set to VALUE. */
+static inline elem_type
+elem_value (const struct bitmap *b, size_t elem_idx, bool value) 
+{
+  return value ? b->bits[elem_idx] : ~b->bits[elem_idx];
+}
+
+/* Returns the number of 1-bits in X.
+   We don't use __builtin_popcount() because without POPCNT
+   support GCC emits a call into libgcc, which the kernel does not
+   link against. */
+static inline size_t
+elem_popcount (elem_type x) 
+{
+  const elem_type m1 = (elem_type) -1 / 3;            /* 0x5555... */
+  const elem_type m2 = (elem_type) -1 / 15 * 3;       /* 0x3333... */
+  const elem_type m4 = (elem_type) -1 / 255 * 15;     /* 0x0f0f... */
+  const elem_type h01 = (elem_type) -1 / 255;         /* 0x0101... */
+
+  x = x - ((x >> 1) & m1);
+  x = (x & m2) + ((x >> 2) & m2);
+  x = (x + (x >> 4)) & m4;
+  return (elem_type) (x * h01) >> (sizeof (elem_type) - 1) * CHAR_BIT;
+}
+
+/* Returns the index of the first bit in B at or after START and
+   before END that is set to VALUE, or END if there is none.
+   Examines a whole element at a time, so that runs of elements
+   with no bit set to VALUE cost one comparison each.  When
+   searching for a false bit, runs of full elements are skipped
+   using the summary instead. */
+static size_t
+find_next (const struct bitmap *b, size_t start, size_t end, bool value) 
+{
+  size_t idx;
+  elem_type bits;
+
+  if (start >= end)
+    return end;
+
+  idx = elem_idx (start);
+  bits = elem_value (b, idx, value) & ((elem_type) -1 << (start % ELEM_BITS));
+  while (bits == 0) 
+    {
+      if (++idx >= elem_cnt (end))
+        return end;
+      if (!value) 
+        {
+          idx = next_nonfull_elem (b, idx, elem_cnt (end));
+          if (idx >= elem_cnt (end))
+            return end;
+        }
+      bits = elem_value (b, idx, value);
+    }
+
+  start = idx * ELEM_BITS + __builtin_ctzl (bits);
+  return start < end ? start : end;
+}
+
 /* Creation and destruction. */
 
 /* Initializes B to be a bitmap of BIT_CNT bits
@@ -82,9 +224,11 @@ bitmap_create (size_t bit_cnt)
   if (b != NULL)
     {
       b->bit_cnt = bit_cnt;
-      b->bits = malloc (byte_cnt (bit_cnt));
+      b->bits = malloc (buf_byte_cnt (bit_cnt));
+      b->full = b->bits + elem_cnt (bit_cnt);
       if (b->bits != NULL || bit_cnt == 0)
         {
+          rebuild_summary (b);
           bitmap_set_all (b, false);
           return b;
         }
@@ -105,6 +249,8 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED)
 
   b->bit_cnt = bit_cnt;
   b->bits = (elem_type *) (b + 1);
+  b->full = b->bits + elem_cnt (bit_cnt);
+  rebuild_summary (b);
   bitmap_set_all (b, false);
   return b;
 }
@@ -114,7 +260,7 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED)
 size_t
 bitmap_buf_size (size_t bit_cnt) 
 {
-  return sizeof (struct bitmap) + byte_cnt (bit_cnt);
+  return sizeof (struct bitmap) + buf_byte_cnt (bit_cnt);
 }
 
 /* Destroys bitmap B, freeing its storage.
@@ -164,6 +310,7 @@ bitmap_mark (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the OR instruction in [IA32-v2b]. */
   asm ("orl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+  update_summary (b, idx);
 }
 
 /* Atomically sets the bit numbered BIT_IDX in B to false. */
@@ -177,6 +324,7 @@ bitmap_reset (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the AND instruction in [IA32-v2a]. */
   asm ("andl %1, %0" : "=m" (b->bits[idx]) : "r" (~mask) : "cc");
+  update_summary (b, idx);
 }
 
 /* Atomically toggles the bit numbered IDX in B;
@@ -192,6 +340,7 @@ bitmap_flip (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the XOR instruction in [IA32-v2b]. */
   asm ("xorl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+  update_summary (b, idx);
 }
 
 /* Returns the value of the bit numbered IDX in B. */
@@ -214,18 +363,35 @@ bitmap_set_all (struct bitmap *b, bool value)
   bitmap_set_multiple (b, 0, bitmap_size (b), value);
 }
 
-/* Sets the CNT bits starting at START in B to VALUE. */
+/* Sets the CNT bits starting at START in B to VALUE.
+   Each element is updated atomically, but the group as a whole
+   is not. */
 void
 bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i;
-  
+  size_t end = start + cnt;
+
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    bitmap_set (b, start + i, value);
+  while (start < end) 
+    {
+      size_t idx = elem_idx (start);
+      size_t elem_end = (idx + 1) * ELEM_BITS;
+      size_t stop = end < elem_end ? end : elem_end;
+      elem_type mask = range_mask (start % ELEM_BITS,
+                                   stop - idx * ELEM_BITS);
+
+      /* Atomic for the same reasons as bitmap_mark() and
+         bitmap_reset(). */
+      if (value)
+        asm ("orl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+      else
+        asm ("andl %1, %0" : "=m" (b->bits[idx]) : "r" (~mask) : "cc");
+      update_summary (b, idx);
+      start = stop;
+    }
 }
 
 /* Returns the number of bits in B between START and START + CNT,
@@ -233,16 +399,25 @@ bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value)
 size_t
 bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i, value_cnt;
+  size_t end = start + cnt;
+  size_t value_cnt;
 
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
   value_cnt = 0;
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      value_cnt++;
+  while (start < end) 
+    {
+      size_t idx = elem_idx (start);
+      size_t elem_end = (idx + 1) * ELEM_BITS;
+      size_t stop = end < elem_end ? end : elem_end;
+      elem_type mask = range_mask (start % ELEM_BITS,
+                                   stop - idx * ELEM_BITS);
+
+      value_cnt += elem_popcount (elem_value (b, idx, value) & mask);
+      start = stop;
+    }
   return value_cnt;
 }
 
@@ -251,16 +426,11 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
 bool
 bitmap_contains (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i;
-  
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      return true;
-  return false;
+  return find_next (b, start, start + cnt, value) < start + cnt;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -299,13 +469,23 @@ bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
 
-  if (cnt <= b->bit_cnt) 
+  if (cnt == 0)
+    return start;
+  while (cnt <= b->bit_cnt && start <= b->bit_cnt - cnt)
     {
-      size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains (b, i, cnt, !value))
-          return i; 
+      size_t mismatch;
+
+      /* Skip to the first bit set to VALUE. */
+      start = find_next (b, start, b->bit_cnt, value);
+      if (start > b->bit_cnt - cnt)
+        break;
+
+      /* If the CNT bits there are all VALUE, we're done.
+         Otherwise, no group can start before the mismatch. */
+      mismatch = find_next (b, start, start + cnt, !value);
+      if (mismatch == start + cnt)
+        return start;
+      start = mismatch + 1;
     }
   return BITMAP_ERROR;
 }
@@ -347,6 +527,7 @@ bitmap_read (struct bitmap *b, struct file *file)
       off_t size = byte_cnt (b->bit_cnt);
       success = file_read_at (file, b->bits, size, 0) == size;
       b->bits[elem_cnt (b->bit_cnt) - 1] &= last_mask (b);
+      rebuild_summary (b);
     }
   return success;
 }
@@ -0,0 +1,143 @@
+#include "crc32c.h"
+#include <debug.h>
+#include <string.h>
+
+/* CRC32C polynomial 0x1edc6f41, bit-reversed. */
+#define POLY 0x82f63b78
+
+/* table[0][B] is the CRC of byte B.  table[K][B] is the CRC of
+   byte B followed by K zero bytes, so that slicing-by-8 can fold
+   in 8 bytes with 8 independent lookups. */
+static uint32_t table[8][256];
+
+/* Set once TABLE has been filled in. */
+static bool table_ready;
+
+/* Whether the CPU has the CRC32 instruction: 0 if not yet
+   known, 1 if it does, -1 if it does not. */
+static int hw_state;
+
+/* Fills in TABLE.  Filling it in twice does no harm, because the
+   same values are stored both times, so no locking is needed. */
+static void
+init_table (void)
+{
+  int i, k;
+
+  for (i = 0; i < 256; i++)
+    {
+      uint32_t crc = i;
+      for (k = 0; k < 8; k++)
+        crc = (crc >> 1) ^ (POLY & -(crc & 1));
+      table[0][i] = crc;
+    }
+  for (i = 0; i < 256; i++)
+    for (k = 1; k < 8; k++)
+      table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+  table_ready = true;
+}
+
+/* Computes the CRC32C of BUF a byte at a time, with a single
+   256-entry table. */
+uint32_t
+crc32c_sb1 (uint32_t crc, const void *buf_, size_t size)
+{
+  const uint8_t *buf = buf_;
+
+  if (!table_ready)
+    init_table ();
+
+  crc = ~crc;
+  while (size-- > 0)
+    crc = table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+/* Computes the CRC32C of BUF 8 bytes at a time with the
+   slicing-by-8 method.  Relies on the CPU being
+   little-endian. */
+uint32_t
+crc32c_sb8 (uint32_t crc, const void *buf_, size_t size)
+{
+  const uint8_t *buf = buf_;
+
+  if (!table_ready)
+    init_table ();
+
+  crc = ~crc;
+
+  /* Align BUF to a 4-byte boundary. */
+  for (; size > 0 && ((uintptr_t) buf & 3) != 0; size--)
+    crc = table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+  for (; size >= 8; size -= 8, buf += 8)
+    {
+      uint32_t lo = *(const uint32_t *) buf ^ crc;
+      uint32_t hi = *(const uint32_t *) (buf + 4);
+      crc = (table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff]
+             ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24]
+             ^ table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff]
+             ^ table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24]);
+    }
+
+  while (size-- > 0)
+    crc = table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+/* Returns true if the CPU supports the SSE4.2 CRC32
+   instruction.  The instruction works on general-purpose
+   registers, so using it does not touch floating-point or SSE
+   state that the kernel does not save. */
+bool
+crc32c_hw_available (void)
+{
+  if (hw_state == 0)
+    {
+      uint32_t before, after, a, b, c, d;
+
+      /* Only CPUs that let us toggle EFLAGS.ID have CPUID. */
+      asm ("pushfl; popl %0; movl %0, %1; xorl $0x200000, %0; "
+           "pushl %0; popfl; pushfl; popl %0; pushl %1; popfl"
+           : "=&r" (after), "=&r" (before) : : "cc");
+      if (((after ^ before) & 0x200000) == 0)
+        hw_state = -1;
+      else
+        {
+          /* CPUID leaf 1 reports SSE4.2 in ECX bit 20. */
+          asm ("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (1));
+          hw_state = c & (1u << 20) ? 1 : -1;
+        }
+    }
+  return hw_state > 0;
+}
+
+/* Computes the CRC32C of BUF with the SSE4.2 CRC32 instruction,
+   4 bytes at a time.  The CPU must support it. */
+uint32_t
+crc32c_hw (uint32_t crc, const void *buf_, size_t size)
+{
+  const uint8_t *buf = buf_;
+
+  ASSERT (crc32c_hw_available ());
+
+  crc = ~crc;
+  for (; size >= 4; size -= 4, buf += 4)
+    {
+      uint32_t word;
+      memcpy (&word, buf, sizeof word);
+      asm ("crc32l %1, %0" : "+r" (crc) : "rm" (word));
+    }
+  for (; size > 0; size--, buf++)
+    asm ("crc32b %1, %0" : "+r" (crc) : "rm" (*buf));
+  return ~crc;
+}
+
+/* Computes the CRC32C of BUF as fast as the CPU allows. */
+uint32_t
+crc32c (uint32_t crc, const void *buf, size_t size)
+{
+  return (crc32c_hw_available ()
+          ? crc32c_hw (crc, buf, size)
+          : crc32c_sb8 (crc, buf, size));
+}
@@ -0,0 +1,25 @@
+#ifndef __LIB_KERNEL_CRC32C_H
+#define __LIB_KERNEL_CRC32C_H
+
+/* CRC32C (Castagnoli) checksums.
+
+   Each function takes CRC, the checksum of the data that
+   precedes BUF, or 0 at the start, and returns the checksum of
+   that data followed by the SIZE bytes in BUF.  All of them
+   compute the same function; they differ only in speed.
+
+   crc32c() uses the SSE4.2 CRC32 instruction if the CPU has it,
+   and the slicing-by-8 table method otherwise.  The others are
+   exposed for testing and benchmarking. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t crc32c (uint32_t crc, const void *buf, size_t size);
+uint32_t crc32c_sb1 (uint32_t crc, const void *buf, size_t size);
+uint32_t crc32c_sb8 (uint32_t crc, const void *buf, size_t size);
+uint32_t crc32c_hw (uint32_t crc, const void *buf, size_t size);
+bool crc32c_hw_available (void);
+
+#endif /* lib/kernel/crc32c.h */
@@ -46,7 +46,7 @@ debug_panic (const char *file, int line, const char *function,
     }
 
   serial_flush ();
-  shutdown ();
+  shutdown_panic ();
   for (;;);
 }
 
@@ -0,0 +1,154 @@
+/* Test and microbenchmark for lib/kernel/bitmap.c.
+
+   Checks the word-at-a-time scanning and counting routines
+   against straightforward bit-at-a-time versions, then times
+   both over 64K-bit maps in the patterns that palloc and the
+   file system free map produce: a full front with free space at
+   the end, and random fragmentation.
+
+   This is not a test we will run on your submitted projects.
+   It is here for completeness.
+*/
+
+#undef NDEBUG
+#include <bitmap.h>
+#include <debug.h>
+#include <inttypes.h>
+#include <random.h>
+#include <stdio.h>
+#include "devices/timer.h"
+#include "threads/test.h"
+
+/* Number of bits in each benchmarked bitmap. */
+#define BIT_CNT 65536
+
+/* Number of times each timed operation is repeated. */
+#define REPEAT_CNT 64
+
+static size_t slow_count (const struct bitmap *, size_t start, size_t cnt,
+                          bool value);
+static size_t slow_scan (const struct bitmap *, size_t start, size_t cnt,
+                         bool value);
+static void verify (const struct bitmap *);
+static void benchmark (const char *name, const struct bitmap *, size_t cnt);
+
+/* Test and time the bitmap implementation. */
+void
+test (void)
+{
+  struct bitmap *b = bitmap_create (BIT_CNT);
+  size_t i;
+
+  ASSERT (b != NULL);
+
+  /* Front 7/8 allocated, as for a disk whose start is full. */
+  bitmap_set_multiple (b, 0, BIT_CNT / 8 * 7, true);
+  verify (b);
+  benchmark ("front-full", b, 1);
+  benchmark ("front-full", b, 8);
+
+  /* Randomly fragmented, about 3/4 allocated. */
+  bitmap_set_all (b, false);
+  for (i = 0; i < BIT_CNT; i++)
+    if (random_ulong () % 4 != 0)
+      bitmap_mark (b, i);
+  verify (b);
+  benchmark ("random-75%", b, 1);
+  benchmark ("random-75%", b, 4);
+
+  bitmap_destroy (b);
+  printf ("bitmap: PASS\n");
+}
+
+/* Checks bitmap_count() and bitmap_scan() on B against the
+   bit-at-a-time versions at a variety of starting points and
+   group sizes. */
+static void
+verify (const struct bitmap *b)
+{
+  size_t start;
+
+  for (start = 0; start < BIT_CNT; start += random_ulong () % 4096 + 1)
+    {
+      size_t cnt = random_ulong () % 40;
+      size_t len = random_ulong () % (BIT_CNT - start + 1);
+
+      ASSERT (bitmap_count (b, start, len, true)
+              == slow_count (b, start, len, true));
+      ASSERT (bitmap_count (b, start, len, false)
+              == slow_count (b, start, len, false));
+      ASSERT (bitmap_scan (b, start, cnt, false)
+              == slow_scan (b, start, cnt, false));
+      ASSERT (bitmap_scan (b, start, cnt, true)
+              == slow_scan (b, start, cnt, true));
+    }
+}
+
+/* Times scanning B for CNT free bits from the beginning, and
+   counting all of its set bits, with both implementations, and
+   prints the results in timer ticks. */
+static void
+benchmark (const char *name, const struct bitmap *b, size_t cnt)
+{
+  int64_t start;
+  int64_t fast_scan_ticks, slow_scan_ticks;
+  int64_t fast_count_ticks, slow_count_ticks;
+  int i;
+
+  start = timer_ticks ();
+  for (i = 0; i < REPEAT_CNT; i++)
+    bitmap_scan (b, 0, cnt, false);
+  fast_scan_ticks = timer_elapsed (start);
+
+  start = timer_ticks ();
+  for (i = 0; i < REPEAT_CNT; i++)
+    slow_scan (b, 0, cnt, false);
+  slow_scan_ticks = timer_elapsed (start);
+
+  start = timer_ticks ();
+  for (i = 0; i < REPEAT_CNT; i++)
+    bitmap_count (b, 0, BIT_CNT, true);
+  fast_count_ticks = timer_elapsed (start);
+
+  start = timer_ticks ();
+  for (i = 0; i < REPEAT_CNT; i++)
+    slow_count (b, 0, BIT_CNT, true);
+  slow_count_ticks = timer_elapsed (start);
+
+  printf ("%s, %zu-bit scan: %"PRId64" ticks (bitwise: %"PRId64"), "
+          "count: %"PRId64" ticks (bitwise: %"PRId64")\n",
+          name, cnt, fast_scan_ticks, slow_scan_ticks,
+          fast_count_ticks, slow_count_ticks);
+}
+
+/* Bit-at-a-time bitmap_count(). */
+static size_t
+slow_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
+{
+  size_t i, value_cnt = 0;
+
+  for (i = 0; i < cnt; i++)
+    if (bitmap_test (b, start + i) == value)
+      value_cnt++;
+  return value_cnt;
+}
+
+/* Bit-at-a-time bitmap_scan(). */
+static size_t
+slow_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
+{
+  size_t bit_cnt = bitmap_size (b);
+  size_t i, j;
+
+  if (cnt > bit_cnt)
+    return BITMAP_ERROR;
+  for (i = start; i <= bit_cnt - cnt; i++)
+    {
+      for (j = 0; j < cnt; j++)
+        if (bitmap_test (b, i + j) != value)
+          break;
+      if (j == cnt)
+        return i;
+    }
+  return BITMAP_ERROR;
+}
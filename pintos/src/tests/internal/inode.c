@@ -0,0 +1,205 @@
+/* Contention benchmark for inode locking in filesys/inode.c.
+
+   Several threads read the same file at once, first alone and
+   then while another thread keeps appending to it.  Readers of
+   existing data hold the inode's lock shared and an appender
+   takes it exclusively only to publish the new length, so the
+   readers' throughput should drop little while the file grows.
+   Every byte read is checked, so the test also catches readers
+   that see a new length before the data behind it.
+
+   Must be run on a formatted file system with room for a file
+   of FILE_SECTORS + APPEND_SECTORS sectors.
+
+   This is not a test we will run on your submitted projects.
+   It is here for completeness.
+*/
+
+#undef NDEBUG
+#include <debug.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include "devices/block.h"
+#include "devices/timer.h"
+#include "filesys/file.h"
+#include "filesys/filesys.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/test.h"
+
+/* Name of the file read and appended to. */
+#define FILE_NAME "/inode-bench"
+
+/* Initial size of the file, in sectors. */
+#define FILE_SECTORS 256
+
+/* Sectors appended during the second pass. */
+#define APPEND_SECTORS 256
+
+/* Number of reader threads. */
+#define READER_CNT 12
+
+/* Times each reader reads the initial part of the file. */
+#define PASS_CNT 4
+
+/* A reader or appender thread's work. */
+struct worker
+  {
+    struct semaphore done;      /* Up'd when finished. */
+    size_t sector_cnt;          /* Sectors read or written. */
+    uint8_t buffer[BLOCK_SECTOR_SIZE]; /* Sector being transferred. */
+  };
+
+static void fill (uint8_t *, size_t sector);
+static bool check (const uint8_t *, size_t sector);
+static void write_sectors (struct file *, uint8_t *,
+                           size_t start, size_t cnt);
+static int64_t run_readers (bool append);
+static thread_func reader_thread, appender_thread;
+
+/* Times concurrent readers with and without a concurrent
+   appender. */
+void
+test (void)
+{
+  static uint8_t buffer[BLOCK_SECTOR_SIZE];
+  struct file *file;
+  int64_t alone, appending;
+
+  ASSERT (filesys_create (FILE_NAME, 0));
+  file = filesys_open (FILE_NAME);
+  ASSERT (file != NULL);
+  write_sectors (file, buffer, 0, FILE_SECTORS);
+  file_close (file);
+
+  alone = run_readers (false);
+  appending = run_readers (true);
+  printf ("%d readers, %d sectors each: %"PRId64" ticks alone, "
+          "%"PRId64" ticks while appending %d sectors\n",
+          READER_CNT, FILE_SECTORS * PASS_CNT, alone, appending,
+          APPEND_SECTORS);
+
+  ASSERT (filesys_remove (FILE_NAME));
+}
+
+/* Fills the sector-sized BUFFER with the contents expected in
+   SECTOR of the file. */
+static void
+fill (uint8_t *buffer, size_t sector)
+{
+  size_t i;
+
+  for (i = 0; i < BLOCK_SECTOR_SIZE; i++)
+    buffer[i] = sector * 7 + i;
+}
+
+/* Returns true if the sector-sized BUFFER holds the contents
+   expected in SECTOR of the file. */
+static bool
+check (const uint8_t *buffer, size_t sector)
+{
+  size_t i;
+
+  for (i = 0; i < BLOCK_SECTOR_SIZE; i++)
+    if (buffer[i] != (uint8_t) (sector * 7 + i))
+      return false;
+  return true;
+}
+
+/* Writes sectors START through START + CNT - 1 of FILE, using
+   the sector-sized BUFFER. */
+static void
+write_sectors (struct file *file, uint8_t *buffer, size_t start, size_t cnt)
+{
+  size_t sector;
+
+  for (sector = start; sector < start + cnt; sector++)
+    {
+      fill (buffer, sector);
+      ASSERT (file_write_at (file, buffer, BLOCK_SECTOR_SIZE,
+                             sector * BLOCK_SECTOR_SIZE)
+              == BLOCK_SECTOR_SIZE);
+    }
+}
+
+/* Runs READER_CNT readers to completion, along with an appender
+   if APPEND is true, and returns the number of ticks that the
+   readers took. */
+static int64_t
+run_readers (bool append)
+{
+  static struct worker readers[READER_CNT], appender;
+  int64_t start, elapsed;
+  int i;
+
+  start = timer_ticks ();
+  if (append)
+    {
+      sema_init (&appender.done, 0);
+      appender.sector_cnt = 0;
+      thread_create ("appender", PRI_DEFAULT, appender_thread, &appender);
+    }
+  for (i = 0; i < READER_CNT; i++)
+    {
+      sema_init (&readers[i].done, 0);
+      readers[i].sector_cnt = 0;
+      thread_create ("reader", PRI_DEFAULT, reader_thread, &readers[i]);
+    }
+  for (i = 0; i < READER_CNT; i++)
+    sema_down (&readers[i].done);
+  elapsed = timer_elapsed (start);
+
+  if (append)
+    {
+      sema_down (&appender.done);
+      ASSERT (appender.sector_cnt == APPEND_SECTORS);
+    }
+  for (i = 0; i < READER_CNT; i++)
+    ASSERT (readers[i].sector_cnt >= FILE_SECTORS * PASS_CNT);
+  return elapsed;
+}
+
+/* Reader thread: reads every sector of the file PASS_CNT times,
+   including any that were appended since the pass began, and
+   checks their contents. */
+static void
+reader_thread (void *worker_)
+{
+  struct worker *worker = worker_;
+  struct file *file = filesys_open (FILE_NAME);
+  int pass;
+
+  ASSERT (file != NULL);
+  for (pass = 0; pass < PASS_CNT; pass++)
+    {
+      size_t sector;
+
+      for (sector = 0;
+           file_read_at (file, worker->buffer, BLOCK_SECTOR_SIZE,
+                         sector * BLOCK_SECTOR_SIZE) == BLOCK_SECTOR_SIZE;
+           sector++)
+        {
+          ASSERT (check (worker->buffer, sector));
+          worker->sector_cnt++;
+        }
+    }
+  file_close (file);
+  sema_up (&worker->done);
+}
+
+/* Appender thread: appends APPEND_SECTORS sectors to the file,
+   one at a time. */
+static void
+appender_thread (void *worker_)
+{
+  struct worker *worker = worker_;
+  struct file *file = filesys_open (FILE_NAME);
+  size_t length;
+
+  ASSERT (file != NULL);
+  length = file_length (file) / BLOCK_SECTOR_SIZE;
+  for (; worker->sector_cnt < APPEND_SECTORS; worker->sector_cnt++)
+    write_sectors (file, worker->buffer, length + worker->sector_cnt, 1);
+  file_close (file);
+  sema_up (&worker->done);
+}
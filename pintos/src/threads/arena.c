@@ -0,0 +1,119 @@
+#include "threads/arena.h"
+#include <debug.h>
+#include <round.h>
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* Header at the start of each page owned by an arena.  The rest
+   of the page holds allocations. */
+struct arena_page
+  {
+    struct list_elem elem;      /* Element in arena's `pages' list. */
+  };
+
+/* Alignment of every allocation. */
+#define ARENA_ALIGN 8
+
+/* Returns the first byte available for allocations in P. */
+static inline uint8_t *
+page_start (struct arena_page *p) 
+{
+  return (uint8_t *) (p + 1);
+}
+
+/* Returns the last page owned by A, which must own at least
+   one. */
+static inline struct arena_page *
+last_page (struct arena *a) 
+{
+  return list_entry (list_back (&a->pages), struct arena_page, elem);
+}
+
+/* Initializes A as an empty arena.  Does not allocate any
+   memory; pages are obtained on first use. */
+void
+arena_init (struct arena *a) 
+{
+  list_init (&a->pages);
+  a->cur = a->end = NULL;
+}
+
+/* Allocates SIZE bytes from A and returns them, aligned to an
+   8-byte boundary.  SIZE must not exceed ARENA_MAX.  Returns a
+   null pointer if a new page is needed and none is available.
+   The memory remains valid until A is reset to a point before
+   it or destroyed. */
+void *
+arena_alloc (struct arena *a, size_t size) 
+{
+  void *p;
+
+  ASSERT (size <= ARENA_MAX);
+
+  size = ROUND_UP (size, ARENA_ALIGN);
+  if (a->cur == NULL || size > (size_t) (a->end - a->cur))
+    {
+      struct arena_page *page = palloc_get_page (0);
+      if (page == NULL)
+        return NULL;
+      list_push_back (&a->pages, &page->elem);
+      a->cur = page_start (page);
+      a->end = (uint8_t *) page + PGSIZE;
+    }
+
+  p = a->cur;
+  a->cur += size;
+  return p;
+}
+
+/* Returns A's current allocation point, for passing to
+   arena_reset(). */
+void *
+arena_top (const struct arena *a) 
+{
+  return a->cur;
+}
+
+/* Releases everything allocated from A since arena_top()
+   returned TOP.  A null TOP releases all of A's allocations.
+   Pages that become unused are returned to the page allocator,
+   except for the first, which is kept for reuse. */
+void
+arena_reset (struct arena *a, void *top_) 
+{
+  uint8_t *top = top_;
+
+  while (!list_empty (&a->pages))
+    {
+      struct arena_page *page = last_page (a);
+      uint8_t *end = (uint8_t *) page + PGSIZE;
+
+      if (top != NULL && top >= page_start (page) && top <= end)
+        {
+          a->cur = top;
+          a->end = end;
+          return;
+        }
+      if (list_front (&a->pages) == &page->elem)
+        {
+          ASSERT (top == NULL);
+          a->cur = page_start (page);
+          a->end = end;
+          return;
+        }
+      list_pop_back (&a->pages);
+      palloc_free_page (page);
+    }
+}
+
+/* Frees all of the pages owned by A. */
+void
+arena_destroy (struct arena *a) 
+{
+  while (!list_empty (&a->pages))
+    {
+      struct list_elem *e = list_pop_front (&a->pages);
+      palloc_free_page (list_entry (e, struct arena_page, elem));
+    }
+  a->cur = a->end = NULL;
+}
@@ -0,0 +1,36 @@
+#ifndef THREADS_ARENA_H
+#define THREADS_ARENA_H
+
+#include <list.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "threads/vaddr.h"
+
+/* Region ("bump") allocator for short-lived kernel allocations.
+
+   An arena hands out memory by advancing a pointer through pages
+   obtained from the page allocator.  Individual allocations are
+   never freed.  Instead, arena_top() records the current
+   allocation point and arena_reset() later releases everything
+   allocated since, all at once.  This makes temporary buffers
+   much cheaper than a malloc()/free() pair.
+
+   Every thread has its own arena (see struct thread), so no
+   locking is needed as long as each thread only uses its own. */
+struct arena
+  {
+    struct list pages;          /* Pages owned by the arena, in order. */
+    uint8_t *cur;               /* Next free byte in the last page. */
+    uint8_t *end;               /* End of the last page. */
+  };
+
+/* Largest single allocation that an arena can satisfy. */
+#define ARENA_MAX (PGSIZE - sizeof (struct list_elem))
+
+void arena_init (struct arena *);
+void *arena_alloc (struct arena *, size_t size);
+void *arena_top (const struct arena *);
+void arena_reset (struct arena *, void *top);
+void arena_destroy (struct arena *);
+
+#endif /* threads/arena.h */
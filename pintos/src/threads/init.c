@@ -19,6 +19,7 @@
 #include "threads/io.h"
 #include "threads/loader.h"
 #include "threads/malloc.h"
+#include "threads/memtrack.h"
 #include "threads/palloc.h"
 #include "threads/pte.h"
 #include "threads/thread.h"
@@ -34,6 +35,7 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "devices/ramdisk.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
 #endif
@@ -52,11 +54,23 @@ static const char *scratch_bdev_name;
 #ifdef VM
 static const char *swap_bdev_name;
 #endif
+
+/* -ramdisk: Size of RAM disk to create, in bytes. */
+static size_t ramdisk_size;
+
+/* -blktrace: Number of block requests to trace. */
+static size_t blktrace_cnt;
 #endif /* FILESYS */
 
 /* -ul: Maximum number of pages to put into palloc's user pool. */
 static size_t user_page_limit = SIZE_MAX;
 
+/* -lend: Which palloc pools may borrow pages from the other. */
+static enum palloc_lending pool_lending = PAL_LEND_NONE;
+
+/* -lendmin: Percentage of each pool that is never lent out. */
+static unsigned lend_reserve_pct = 12;
+
 static void bss_init (void);
 static void paging_init (void);
 
@@ -64,8 +78,10 @@ static char **read_command_line (void);
 static char **parse_options (char **argv);
 static void run_actions (char **argv);
 static void usage (void);
+static enum palloc_lending parse_lending (const char *);
 
 #ifdef FILESYS
+static size_t parse_size (const char *option, const char *size);
 static void locate_block_devices (void);
 static void locate_block_device (enum block_type, const char *name);
 #endif
@@ -95,8 +111,11 @@ main (void)
           init_ram_pages * PGSIZE / 1024);
 
   /* Initialize memory system. */
-  palloc_init (user_page_limit);
+  palloc_init (user_page_limit, pool_lending, lend_reserve_pct);
   malloc_init ();
+#ifdef MEMTRACK
+  memtrack_init ();
+#endif
   paging_init ();
 
   /* Segmentation. */
@@ -122,7 +141,9 @@ main (void)
 
 #ifdef FILESYS
   /* Initialize file system. */
+  block_trace_init (blktrace_cnt);
   ide_init ();
+  ramdisk_init (ramdisk_size);
   locate_block_devices ();
   filesys_init (format_filesys);
 #endif
@@ -247,6 +268,15 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-ramdisk"))
+        ramdisk_size = parse_size (name, value);
+      else if (!strcmp (name, "-blktrace"))
+        blktrace_cnt = value != NULL ? (size_t) atoi (value) : 8192;
+      else if (!strcmp (name, "-iosched"))
+        {
+          if (value == NULL || !block_set_scheduler (value))
+            PANIC ("unknown I/O scheduler `%s' (use -h for help)", value);
+        }
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -256,6 +286,14 @@ parse_options (char **argv)
         random_init (atoi (value));
       else if (!strcmp (name, "-mlfqs"))
         thread_mlfqs = true;
+      else if (!strcmp (name, "-lend"))
+        pool_lending = parse_lending (value);
+      else if (!strcmp (name, "-lendmin"))
+        {
+          lend_reserve_pct = atoi (value);
+          if (lend_reserve_pct > 100)
+            PANIC ("-lendmin must be between 0 and 100");
+        }
 #ifdef USERPROG
       else if (!strcmp (name, "-ul"))
         user_page_limit = atoi (value);
@@ -277,6 +315,57 @@ parse_options (char **argv)
   return argv;
 }
 
+/* Parses the argument to the -lend option. */
+static enum palloc_lending
+parse_lending (const char *who)
+{
+  if (who == NULL)
+    PANIC ("-lend requires an argument (use -h for help)");
+  else if (!strcmp (who, "none"))
+    return PAL_LEND_NONE;
+  else if (!strcmp (who, "kernel"))
+    return PAL_LEND_KERNEL;
+  else if (!strcmp (who, "user"))
+    return PAL_LEND_USER;
+  else if (!strcmp (who, "both"))
+    return PAL_LEND_BOTH;
+  else
+    PANIC ("unknown -lend policy `%s' (use -h for help)", who);
+}
+
+#ifdef FILESYS
+/* Parses SIZE, the argument to OPTION, as a number of bytes
+   optionally followed by K, M, or G to multiply it by 1024,
+   1024*1024, or 1024*1024*1024. */
+static size_t
+parse_size (const char *option, const char *size)
+{
+  const char *p;
+  size_t n = 0;
+  size_t unit = 1;
+
+  if (size == NULL || *size == '\0')
+    PANIC ("%s requires an argument (use -h for help)", option);
+  for (p = size; *p >= '0' && *p <= '9'; p++)
+    {
+      if (n > (SIZE_MAX - (*p - '0')) / 10)
+        PANIC ("size `%s' for %s is too large", size, option);
+      n = n * 10 + (*p - '0');
+    }
+  if (*p == 'K' || *p == 'k')
+    unit = 1024, p++;
+  else if (*p == 'M' || *p == 'm')
+    unit = 1024 * 1024, p++;
+  else if (*p == 'G' || *p == 'g')
+    unit = 1024 * 1024 * 1024, p++;
+  if (*p != '\0')
+    PANIC ("bad size `%s' for %s (use -h for help)", size, option);
+  if (n > SIZE_MAX / unit)
+    PANIC ("size `%s' for %s is too large", size, option);
+  return n * unit;
+}
+#endif
+
 /* Runs the task specified in ARGV[1]. */
 static void
 run_task (char **argv)
@@ -373,12 +462,23 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -iosched=NAME      Use I/O scheduler NAME (deadline, clook,\n"
+          "                     or fifo) for block devices.\n"
+          "  -ramdisk=SIZE      Create RAM disk ram0 of SIZE bytes, with\n"
+          "                     optional K, M, or G suffix.  Use it with\n"
+          "                     -filesys=ram0 or -scratch=ram0.\n"
+          "  -blktrace[=CNT]    Trace up to CNT block requests (default\n"
+          "                     8192) and save the trace to the scratch\n"
+          "                     device at shutdown.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
 #endif
           "  -rs=SEED           Set random number seed to SEED.\n"
           "  -mlfqs             Use multi-level feedback queue scheduler.\n"
+          "  -lend=WHO          Let WHO (none, kernel, user, or both) borrow\n"
+          "                     pages from the other pool when short of them.\n"
+          "  -lendmin=PCT       Never lend out the last PCT%% of a pool.\n"
 #ifdef USERPROG
           "  -ul=COUNT          Limit user memory to COUNT pages.\n"
 #endif
@@ -391,17 +491,20 @@ usage (void)
 static void
 locate_block_devices (void)
 {
+  /* Swap goes before scratch, which is used only at startup and
+     shutdown, so that it gets first pick of the channels that the
+     file system is not on. */
   locate_block_device (BLOCK_FILESYS, filesys_bdev_name);
-  locate_block_device (BLOCK_SCRATCH, scratch_bdev_name);
 #ifdef VM
   locate_block_device (BLOCK_SWAP, swap_bdev_name);
 #endif
+  locate_block_device (BLOCK_SCRATCH, scratch_bdev_name);
 }
 
 /* Figures out what block device to use for the given ROLE: the
    block device with the given NAME, if NAME is non-null,
-   otherwise the first block device in probe order of type
-   ROLE. */
+   otherwise the block device of type ROLE chosen by
+   block_find_role(), which spreads roles across channels. */
 static void
 locate_block_device (enum block_type role, const char *name)
 {
@@ -414,11 +517,7 @@ locate_block_device (enum block_type role, const char *name)
         PANIC ("No such block device \"%s\"", name);
     }
   else
-    {
-      for (block = block_first (); block != NULL; block = block_next (block))
-        if (block_type (block) == role)
-          break;
-    }
+    block = block_find_role (role);
 
   if (block != NULL)
     {
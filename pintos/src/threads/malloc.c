@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "threads/memtrack.h"
 #include "threads/palloc.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
@@ -32,7 +33,12 @@
    because they're too big to fit in a single page with a
    descriptor.  We handle those by allocating contiguous pages
    with the page allocator and sticking the allocation size at
-   the beginning of the allocated block's arena header. */
+   the beginning of the allocated block's arena header.
+
+   Pages obtained here are hidden from the allocation tracker
+   with PAL_NOTRACK: the blocks carved from them are tracked
+   individually instead, and the tracker must never be entered
+   while a descriptor lock is held. */
 
 /* Descriptor. */
 struct desc
@@ -107,7 +113,7 @@ malloc (size_t size)
       /* SIZE is too big for any descriptor.
          Allocate enough pages to hold SIZE plus an arena. */
       size_t page_cnt = DIV_ROUND_UP (size + sizeof *a, PGSIZE);
-      a = palloc_get_multiple (0, page_cnt);
+      a = palloc_get_multiple (PAL_NOTRACK, page_cnt);
       if (a == NULL)
         return NULL;
 
@@ -116,6 +122,10 @@ malloc (size_t size)
       a->magic = ARENA_MAGIC;
       a->desc = NULL;
       a->free_cnt = page_cnt;
+#ifdef MEMTRACK
+      memtrack_alloc (MEMTRACK_MALLOC, a + 1, size,
+                      __builtin_return_address (0));
+#endif
       return a + 1;
     }
 
@@ -127,7 +137,7 @@ malloc (size_t size)
       size_t i;
 
       /* Allocate a page. */
-      a = palloc_get_page (0);
+      a = palloc_get_page (PAL_NOTRACK);
       if (a == NULL) 
         {
           lock_release (&d->lock);
@@ -150,6 +160,9 @@ malloc (size_t size)
   a = block_to_arena (b);
   a->free_cnt--;
   lock_release (&d->lock);
+#ifdef MEMTRACK
+  memtrack_alloc (MEMTRACK_MALLOC, b, size, __builtin_return_address (0));
+#endif
   return b;
 }
 
@@ -170,6 +183,9 @@ calloc (size_t a, size_t b)
   p = malloc (size);
   if (p != NULL)
     memset (p, 0, size);
+#ifdef MEMTRACK
+  memtrack_set_caller (p, __builtin_return_address (0));
+#endif
 
   return p;
 }
@@ -209,6 +225,9 @@ realloc (void *old_block, size_t new_size)
           memcpy (new_block, old_block, min_size);
           free (old_block);
         }
+#ifdef MEMTRACK
+      memtrack_set_caller (new_block, __builtin_return_address (0));
+#endif
       return new_block;
     }
 }
@@ -223,6 +242,10 @@ free (void *p)
       struct block *b = p;
       struct arena *a = block_to_arena (b);
       struct desc *d = a->desc;
+
+#ifdef MEMTRACK
+      memtrack_free (p);
+#endif
       
       if (d != NULL) 
         {
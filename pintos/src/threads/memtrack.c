@@ -0,0 +1,271 @@
+#include "threads/memtrack.h"
+#ifdef MEMTRACK
+#include <debug.h>
+#include <hash.h>
+#include <inttypes.h>
+#include <list.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "devices/timer.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* Kernel memory allocation tracker.
+
+   Every outstanding allocation made through malloc() or
+   palloc_get_multiple() is recorded in a hash table keyed by its
+   address, along with its size, the address of the code that
+   asked for it, and the timer tick at which it was made.  At
+   shutdown, memtrack_print_stats() groups the allocations that
+   are still live by call site.  The call site addresses can be
+   turned into function names with the `backtrace' utility.
+
+   The tracker must not track itself.  The hash table's buckets
+   come from malloc() and its records from palloc_get_page(), so
+   any allocation made by a thread that already holds the tracker
+   lock is silently ignored.  The allocators themselves are
+   careful never to call into the tracker while holding one of
+   their own locks, so that the tracker lock is always acquired
+   first. */
+
+/* A live allocation. */
+struct record
+  {
+    struct hash_elem hash_elem;         /* Element in `live', or
+                                           free_records when unused. */
+    void *addr;                         /* Address returned to caller. */
+    size_t size;                        /* Bytes requested. */
+    void *caller;                       /* Return address of caller. */
+    int64_t time;                       /* Timer tick when allocated. */
+    enum memtrack_kind kind;            /* Allocator used. */
+  };
+
+/* Live allocations, keyed by address. */
+static struct hash live;
+
+/* Unused records. */
+static struct list free_records;
+
+/* Protects all of the above. */
+static struct lock memtrack_lock;
+
+/* Set once memtrack_init() has run. */
+static bool memtrack_ready;
+
+/* Number of allocations that could not be recorded because no
+   memory was available for a record. */
+static size_t dropped_cnt;
+
+static hash_hash_func record_hash;
+static hash_less_func record_less;
+static struct record *find_record (void *);
+static struct record *get_record (void);
+
+/* Initializes the tracker.  Allocations made before this is
+   called are not tracked. */
+void
+memtrack_init (void)
+{
+  lock_init (&memtrack_lock);
+  list_init (&free_records);
+  if (!hash_init (&live, record_hash, record_less, NULL))
+    PANIC ("memtrack: hash table creation failed");
+  memtrack_ready = true;
+}
+
+/* Records that SIZE bytes at ADDR were just allocated from the
+   allocator of the given KIND on behalf of the code at CALLER.
+   Does nothing if ADDR is null. */
+void
+memtrack_alloc (enum memtrack_kind kind, void *addr, size_t size,
+                void *caller)
+{
+  struct record *r;
+
+  if (addr == NULL || !memtrack_ready
+      || lock_held_by_current_thread (&memtrack_lock))
+    return;
+
+  lock_acquire (&memtrack_lock);
+  r = get_record ();
+  if (r != NULL)
+    {
+      r->addr = addr;
+      r->size = size;
+      r->caller = caller;
+      r->time = timer_ticks ();
+      r->kind = kind;
+      hash_insert (&live, &r->hash_elem);
+    }
+  else
+    dropped_cnt++;
+  lock_release (&memtrack_lock);
+}
+
+/* Attributes the live allocation at ADDR to CALLER.  Used by
+   wrappers such as calloc() so that allocations are charged to
+   their real caller rather than to the wrapper. */
+void
+memtrack_set_caller (void *addr, void *caller)
+{
+  struct record *r;
+
+  if (addr == NULL || !memtrack_ready
+      || lock_held_by_current_thread (&memtrack_lock))
+    return;
+
+  lock_acquire (&memtrack_lock);
+  r = find_record (addr);
+  if (r != NULL)
+    r->caller = caller;
+  lock_release (&memtrack_lock);
+}
+
+/* Records that the allocation at ADDR has been freed.
+   Does nothing if ADDR is not being tracked. */
+void
+memtrack_free (void *addr)
+{
+  struct record *r;
+
+  if (addr == NULL || !memtrack_ready
+      || lock_held_by_current_thread (&memtrack_lock))
+    return;
+
+  lock_acquire (&memtrack_lock);
+  r = find_record (addr);
+  if (r != NULL)
+    {
+      hash_delete (&live, &r->hash_elem);
+      list_push_front (&free_records, &r->hash_elem.list_elem);
+    }
+  lock_release (&memtrack_lock);
+}
+
+/* Allocations still live at a single call site. */
+struct site
+  {
+    void *caller;                       /* Return address of caller. */
+    enum memtrack_kind kind;            /* Allocator used. */
+    size_t cnt;                         /* Number of live allocations. */
+    size_t bytes;                       /* Total live bytes. */
+    int64_t oldest;                     /* Tick of oldest allocation. */
+  };
+
+/* Maximum number of call sites reported individually. */
+#define SITE_CNT 32
+
+/* Prints live allocations grouped by call site. */
+void
+memtrack_print_stats (void)
+{
+  static struct site sites[SITE_CNT];
+  size_t site_cnt = 0;
+  size_t other_cnt = 0, other_bytes = 0;
+  size_t total_cnt = 0, total_bytes = 0;
+  struct hash_iterator i;
+  size_t j;
+
+  if (!memtrack_ready || lock_held_by_current_thread (&memtrack_lock))
+    return;
+
+  lock_acquire (&memtrack_lock);
+  hash_first (&i, &live);
+  while (hash_next (&i))
+    {
+      struct record *r = hash_entry (hash_cur (&i), struct record, hash_elem);
+      struct site *s;
+
+      total_cnt++;
+      total_bytes += r->size;
+
+      for (s = sites; s < sites + site_cnt; s++)
+        if (s->caller == r->caller && s->kind == r->kind)
+          break;
+      if (s == sites + site_cnt)
+        {
+          if (site_cnt >= SITE_CNT)
+            {
+              other_cnt++;
+              other_bytes += r->size;
+              continue;
+            }
+          site_cnt++;
+          s->caller = r->caller;
+          s->kind = r->kind;
+          s->cnt = s->bytes = 0;
+          s->oldest = r->time;
+        }
+      s->cnt++;
+      s->bytes += r->size;
+      if (r->time < s->oldest)
+        s->oldest = r->time;
+    }
+  lock_release (&memtrack_lock);
+
+  printf ("Memtrack: %zu live allocations, %zu bytes, %zu untracked\n",
+          total_cnt, total_bytes, dropped_cnt);
+  for (j = 0; j < site_cnt; j++)
+    {
+      struct site *s = &sites[j];
+      printf ("  %s %p: %zu live, %zu bytes, oldest from tick %"PRId64"\n",
+              s->kind == MEMTRACK_MALLOC ? "malloc" : "palloc",
+              s->caller, s->cnt, s->bytes, s->oldest);
+    }
+  if (other_cnt > 0)
+    printf ("  other call sites: %zu live, %zu bytes\n",
+            other_cnt, other_bytes);
+}
+
+/* Returns the live record for ADDR, or a null pointer if there
+   is none. */
+static struct record *
+find_record (void *addr)
+{
+  struct record key;
+  struct hash_elem *e;
+
+  key.addr = addr;
+  e = hash_find (&live, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct record, hash_elem) : NULL;
+}
+
+/* Returns an unused record, carving a fresh page into records if
+   there are none.  Returns a null pointer if no page is
+   available. */
+static struct record *
+get_record (void)
+{
+  if (list_empty (&free_records))
+    {
+      struct record *page = palloc_get_page (PAL_NOTRACK);
+      size_t i;
+
+      if (page == NULL)
+        return NULL;
+      for (i = 0; i < PGSIZE / sizeof *page; i++)
+        list_push_back (&free_records, &page[i].hash_elem.list_elem);
+    }
+  return list_entry (list_pop_front (&free_records),
+                     struct record, hash_elem.list_elem);
+}
+
+/* Returns a hash value for record E. */
+static unsigned
+record_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct record *r = hash_entry (e, struct record, hash_elem);
+  return hash_bytes (&r->addr, sizeof r->addr);
+}
+
+/* Returns true if record A precedes record B. */
+static bool
+record_less (const struct hash_elem *a_, const struct hash_elem *b_,
+             void *aux UNUSED)
+{
+  const struct record *a = hash_entry (a_, struct record, hash_elem);
+  const struct record *b = hash_entry (b_, struct record, hash_elem);
+  return a->addr < b->addr;
+}
+#endif /* MEMTRACK */
@@ -0,0 +1,25 @@
+#ifndef THREADS_MEMTRACK_H
+#define THREADS_MEMTRACK_H
+
+#include <stddef.h>
+
+/* Kernel memory allocation tracker.
+
+   Only compiled in when MEMTRACK is defined (see Make.config).
+   Callers must guard every use with #ifdef MEMTRACK, so that the
+   tracker costs nothing when it is turned off. */
+
+/* Kind of tracked allocation. */
+enum memtrack_kind
+  {
+    MEMTRACK_MALLOC,            /* malloc(), calloc(), realloc(). */
+    MEMTRACK_PALLOC             /* palloc_get_page(), palloc_get_multiple(). */
+  };
+
+void memtrack_init (void);
+void memtrack_alloc (enum memtrack_kind, void *, size_t size, void *caller);
+void memtrack_set_caller (void *, void *caller);
+void memtrack_free (void *);
+void memtrack_print_stats (void);
+
+#endif /* threads/memtrack.h */
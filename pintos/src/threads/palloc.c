@@ -7,7 +7,9 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "threads/interrupt.h"
 #include "threads/loader.h"
+#include "threads/memtrack.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
 
@@ -23,14 +25,58 @@
 
    By default, half of system RAM is given to the kernel pool and
    half to the user pool.  That should be huge overkill for the
-   kernel pool, but that's just fine for demonstration purposes. */
+   kernel pool, but that's just fine for demonstration purposes.
+
+   Optionally (see palloc_init()), a pool that runs out of pages
+   may borrow from the other one.  Pages are lent LOAN_PAGES at a
+   time: the lender marks the whole chunk as used in its own
+   bitmap, and the borrower hands out pages from the chunk until
+   every page in it has been freed again, at which point the
+   chunk goes back to the lender.  A lender never lends pages
+   that would leave it with fewer free pages than its reserve
+   (its low watermark).
+
+   Loans are read and changed only with interrupts disabled,
+   rather than under the borrower's lock, because pages are
+   freed from inside the scheduler (see thread_schedule_tail()),
+   which must not sleep. */
+
+/* Number of pages lent by one pool to the other at a time. */
+#define LOAN_PAGES 32
+
+/* Maximum number of loans that a pool may hold at once. */
+#define LOAN_MAX 16
+
+/* A chunk of LOAN_PAGES pages borrowed from another pool. */
+struct loan
+  {
+    uint8_t *base;                      /* First page; null if unused. */
+    uint32_t used;                      /* Bit K set if page K in use. */
+  };
 
 /* A memory pool. */
 struct pool
   {
     struct lock lock;                   /* Mutual exclusion. */
     struct bitmap *used_map;            /* Bitmap of free pages. */
+    size_t next_idx;                    /* Where the next search starts. */
     uint8_t *base;                      /* Base of pool. */
+    const char *name;                   /* Pool name, for statistics. */
+
+    /* Borrowing. */
+    struct pool *lender;                /* Pool to borrow from, if any. */
+    size_t reserve;                     /* Pages never lent to others. */
+    struct loan loans[LOAN_MAX];        /* Chunks borrowed from lender. */
+    size_t borrow_cnt;                  /* Loans obtained from lender. */
+    size_t return_cnt;                  /* Loans given back to lender. */
+    size_t borrowed_page_cnt;           /* Pages allocated from loans. */
+#ifdef MEMTRACK
+    struct bitmap *tracked_map;         /* Pages known to memtrack. */
+    size_t used_cnt;                    /* Number of pages in use.
+                                           Updated with interrupts
+                                           off, not under `lock'. */
+    size_t max_used_cnt;                /* High-water mark of used_cnt. */
+#endif
   };
 
 /* Two pools: one for kernel data, one for user pages. */
@@ -38,12 +84,20 @@ static struct pool kernel_pool, user_pool;
 
 static void init_pool (struct pool *, void *base, size_t page_cnt,
                        const char *name);
+static void *alloc_from_loans (struct pool *, size_t page_cnt);
+static bool borrow (struct pool *);
+static struct loan *find_loan (struct pool *, void *page);
 static bool page_from_pool (const struct pool *, void *page);
 
 /* Initializes the page allocator.  At most USER_PAGE_LIMIT
-   pages are put into the user pool. */
+   pages are put into the user pool.
+
+   LENDING says which pools may borrow pages from the other when
+   they run out.  A lending pool keeps RESERVE_PCT percent of
+   its pages for itself. */
 void
-palloc_init (size_t user_page_limit)
+palloc_init (size_t user_page_limit, enum palloc_lending lending,
+             unsigned reserve_pct)
 {
   /* Free memory starts at 1 MB and runs to the end of RAM. */
   uint8_t *free_start = ptov (1024 * 1024);
@@ -59,6 +113,14 @@ palloc_init (size_t user_page_limit)
   init_pool (&kernel_pool, free_start, kernel_pages, "kernel pool");
   init_pool (&user_pool, free_start + kernel_pages * PGSIZE,
              user_pages, "user pool");
+
+  ASSERT (reserve_pct <= 100);
+  kernel_pool.reserve = bitmap_size (kernel_pool.used_map) * reserve_pct / 100;
+  user_pool.reserve = bitmap_size (user_pool.used_map) * reserve_pct / 100;
+  if (lending == PAL_LEND_KERNEL || lending == PAL_LEND_BOTH)
+    kernel_pool.lender = &user_pool;
+  if (lending == PAL_LEND_USER || lending == PAL_LEND_BOTH)
+    user_pool.lender = &kernel_pool;
 }
 
 /* Obtains and returns a group of PAGE_CNT contiguous free pages.
@@ -66,7 +128,8 @@ palloc_init (size_t user_page_limit)
    otherwise from the kernel pool.  If PAL_ZERO is set in FLAGS,
    then the pages are filled with zeros.  If too few pages are
    available, returns a null pointer, unless PAL_ASSERT is set in
-   FLAGS, in which case the kernel panics. */
+   FLAGS, in which case the kernel panics.  If PAL_NOTRACK is set,
+   the pages are not recorded by the allocation tracker. */
 void *
 palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
 {
@@ -77,14 +140,54 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
   if (page_cnt == 0)
     return NULL;
 
+  /* Next fit: resume searching just past the previous
+     allocation, wrapping around to the start of the pool if
+     nothing fits beyond it.  If the pool is full, fall back to
+     pages it has borrowed. */
+  pages = NULL;
   lock_acquire (&pool->lock);
-  page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
-  lock_release (&pool->lock);
-
+  page_idx = bitmap_scan_and_flip (pool->used_map, pool->next_idx,
+                                   page_cnt, false);
+  if (page_idx == BITMAP_ERROR && pool->next_idx != 0)
+    page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
+  if (page_idx != BITMAP_ERROR)
+    pool->next_idx = page_idx + page_cnt;
   if (page_idx != BITMAP_ERROR)
     pages = pool->base + PGSIZE * page_idx;
-  else
-    pages = NULL;
+  else if (pool->lender != NULL)
+    pages = alloc_from_loans (pool, page_cnt);
+  lock_release (&pool->lock);
+
+  /* Still nothing: try to borrow a new chunk.  The lender's lock
+     is never acquired while holding our own, so two pools
+     borrowing from each other cannot deadlock. */
+  if (pages == NULL && pool->lender != NULL && borrow (pool)) 
+    {
+      lock_acquire (&pool->lock);
+      pages = alloc_from_loans (pool, page_cnt);
+      lock_release (&pool->lock);
+    }
+
+#ifdef MEMTRACK
+  if (pages != NULL)
+    {
+      struct pool *owner = (page_from_pool (&kernel_pool, pages)
+                            ? &kernel_pool : &user_pool);
+      enum intr_level old_level = intr_disable ();
+
+      pool->used_cnt += page_cnt;
+      if (pool->used_cnt > pool->max_used_cnt)
+        pool->max_used_cnt = pool->used_cnt;
+      intr_set_level (old_level);
+      if (!(flags & PAL_NOTRACK))
+        bitmap_set_multiple (owner->tracked_map,
+                             pg_no (pages) - pg_no (owner->base),
+                             page_cnt, true);
+    }
+  if (!(flags & PAL_NOTRACK))
+    memtrack_alloc (MEMTRACK_PALLOC, pages, PGSIZE * page_cnt,
+                    __builtin_return_address (0));
+#endif
 
   if (pages != NULL) 
     {
@@ -110,15 +213,24 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
 void *
 palloc_get_page (enum palloc_flags flags) 
 {
+#ifdef MEMTRACK
+  void *page = palloc_get_multiple (flags, 1);
+  if (!(flags & PAL_NOTRACK))
+    memtrack_set_caller (page, __builtin_return_address (0));
+  return page;
+#else
   return palloc_get_multiple (flags, 1);
+#endif
 }
 
 /* Frees the PAGE_CNT pages starting at PAGES. */
 void
 palloc_free_multiple (void *pages, size_t page_cnt) 
 {
-  struct pool *pool;
+  struct pool *pool, *borrower;
   size_t page_idx;
+  struct loan *loan = NULL;
+  uint8_t *returned = NULL;
 
   ASSERT (pg_ofs (pages) == 0);
   if (pages == NULL || page_cnt == 0)
@@ -137,8 +249,55 @@ palloc_free_multiple (void *pages, size_t page_cnt)
   memset (pages, 0xcc, PGSIZE * page_cnt);
 #endif
 
+  /* If the pages were lent to the other pool, give them back to
+     the loan, and give the loan back to POOL once it is unused. */
+  borrower = pool == &kernel_pool ? &user_pool : &kernel_pool;
+  if (borrower->lender == pool) 
+    {
+      enum intr_level old_level = intr_disable ();
+      loan = find_loan (borrower, pages);
+      if (loan != NULL)
+        {
+          size_t ofs = pg_no (pages) - pg_no (loan->base);
+          uint32_t mask = (page_cnt < 32 ? (1u << page_cnt) - 1 : ~0u) << ofs;
+
+          ASSERT ((loan->used & mask) == mask);
+          loan->used &= ~mask;
+          borrower->borrowed_page_cnt -= page_cnt;
+          if (loan->used == 0) 
+            {
+              returned = loan->base;
+              loan->base = NULL;
+              borrower->return_cnt++;
+            }
+        }
+      intr_set_level (old_level);
+    }
+
+#ifdef MEMTRACK
+  /* Pages allocated with PAL_NOTRACK may be freed by code that
+     holds one of malloc()'s locks, or by the scheduler, neither
+     of which may acquire the tracker's lock, so only consult the
+     tracker for pages it knows about.  The usage count is kept
+     with interrupts off for the same reason. */
+  if (bitmap_test (pool->tracked_map, page_idx))
+    {
+      bitmap_set_multiple (pool->tracked_map, page_idx, page_cnt, false);
+      memtrack_free (pages);
+    }
+  {
+    enum intr_level old_level = intr_disable ();
+    (loan != NULL ? borrower : pool)->used_cnt -= page_cnt;
+    intr_set_level (old_level);
+  }
+#endif
+
   ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
-  bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+  if (loan == NULL)
+    bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+  else if (returned != NULL)
+    bitmap_set_multiple (pool->used_map, pg_no (returned) - pg_no (pool->base),
+                         LOAN_PAGES, false);
 }
 
 /* Frees the page at PAGE. */
@@ -157,6 +316,10 @@ init_pool (struct pool *p, void *base, size_t page_cnt, const char *name)
      Calculate the space needed for the bitmap
      and subtract it from the pool's size. */
   size_t bm_pages = DIV_ROUND_UP (bitmap_buf_size (page_cnt), PGSIZE);
+#ifdef MEMTRACK
+  size_t tm_pages = bm_pages;
+  bm_pages *= 2;
+#endif
   if (bm_pages > page_cnt)
     PANIC ("Not enough memory in %s for bitmap.", name);
   page_cnt -= bm_pages;
@@ -166,7 +329,139 @@ init_pool (struct pool *p, void *base, size_t page_cnt, const char *name)
   /* Initialize the pool. */
   lock_init (&p->lock);
   p->used_map = bitmap_create_in_buf (page_cnt, base, bm_pages * PGSIZE);
+  p->next_idx = 0;
   p->base = base + bm_pages * PGSIZE;
+  p->name = name;
+  p->lender = NULL;
+  p->reserve = 0;
+  memset (p->loans, 0, sizeof p->loans);
+  p->borrow_cnt = p->return_cnt = p->borrowed_page_cnt = 0;
+#ifdef MEMTRACK
+  p->tracked_map = bitmap_create_in_buf (page_cnt, base + tm_pages * PGSIZE,
+                                         tm_pages * PGSIZE);
+  p->used_cnt = p->max_used_cnt = 0;
+#endif
+}
+
+/* Allocates PAGE_CNT contiguous pages from one of the chunks
+   that POOL has borrowed and returns the first, or returns a
+   null pointer if none of them has room.  POOL's lock must be
+   held. */
+static void *
+alloc_from_loans (struct pool *pool, size_t page_cnt) 
+{
+  enum intr_level old_level;
+  uint8_t *pages = NULL;
+  uint32_t mask;
+  struct loan *l;
+
+  ASSERT (lock_held_by_current_thread (&pool->lock));
+
+  if (page_cnt > LOAN_PAGES)
+    return NULL;
+  mask = page_cnt < 32 ? (1u << page_cnt) - 1 : ~0u;
+
+  old_level = intr_disable ();
+  for (l = pool->loans; l < pool->loans + LOAN_MAX && pages == NULL; l++)
+    if (l->base != NULL)
+      {
+        size_t ofs;
+
+        for (ofs = 0; ofs + page_cnt <= LOAN_PAGES; ofs++)
+          if ((l->used & (mask << ofs)) == 0)
+            {
+              l->used |= mask << ofs;
+              pool->borrowed_page_cnt += page_cnt;
+              pages = l->base + PGSIZE * ofs;
+              break;
+            }
+      }
+  intr_set_level (old_level);
+  return pages;
+}
+
+/* Borrows a chunk of LOAN_PAGES pages for POOL from its lender.
+   Returns true if successful, false if POOL already holds as
+   many loans as it can or if lending a chunk would take the
+   lender below its reserve.  POOL's lock must not be held. */
+static bool
+borrow (struct pool *pool) 
+{
+  struct pool *lender = pool->lender;
+  size_t idx = BITMAP_ERROR;
+  enum intr_level old_level;
+  struct loan *l;
+
+  lock_acquire (&lender->lock);
+  if (bitmap_count (lender->used_map, 0, bitmap_size (lender->used_map), false)
+      >= lender->reserve + LOAN_PAGES)
+    idx = bitmap_scan_and_flip (lender->used_map, 0, LOAN_PAGES, false);
+  lock_release (&lender->lock);
+  if (idx == BITMAP_ERROR)
+    return false;
+
+  lock_acquire (&pool->lock);
+  old_level = intr_disable ();
+  for (l = pool->loans; l < pool->loans + LOAN_MAX; l++)
+    if (l->base == NULL)
+      {
+        l->base = lender->base + PGSIZE * idx;
+        l->used = 0;
+        pool->borrow_cnt++;
+        break;
+      }
+  intr_set_level (old_level);
+  lock_release (&pool->lock);
+
+  if (l == pool->loans + LOAN_MAX)
+    {
+      /* No free slot: give the chunk right back. */
+      bitmap_set_multiple (lender->used_map, idx, LOAN_PAGES, false);
+      return false;
+    }
+  return true;
+}
+
+/* Returns the loan held by POOL that contains PAGE, or a null
+   pointer if there is none.  Interrupts must be off. */
+static struct loan *
+find_loan (struct pool *pool, void *page) 
+{
+  struct loan *l;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  for (l = pool->loans; l < pool->loans + LOAN_MAX; l++)
+    if (l->base != NULL
+        && (uint8_t *) page >= l->base
+        && (uint8_t *) page < l->base + PGSIZE * LOAN_PAGES)
+      return l;
+  return NULL;
+}
+
+/* Prints statistics on borrowing between the pools, if it is
+   enabled, and on page usage if the allocation tracker is. */
+void
+palloc_print_stats (void) 
+{
+  const struct pool *pools[] = {&kernel_pool, &user_pool};
+  size_t i;
+
+  for (i = 0; i < sizeof pools / sizeof *pools; i++)
+    {
+      const struct pool *p = pools[i];
+
+      if (p->lender != NULL)
+        printf ("%s: %zu loans from %s, %zu returned, "
+                "%zu borrowed pages in use\n",
+                p->name, p->borrow_cnt, p->lender->name, p->return_cnt,
+                p->borrowed_page_cnt);
+#ifdef MEMTRACK
+      printf ("%s: %zu of %zu pages in use, high-water mark %zu pages\n",
+              p->name, p->used_cnt, bitmap_size (p->used_map),
+              p->max_used_cnt);
+#endif
+    }
 }
 
 /* Returns true if PAGE was allocated from POOL,
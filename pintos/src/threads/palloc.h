@@ -8,13 +8,25 @@ enum palloc_flags
   {
     PAL_ASSERT = 001,           /* Panic on failure. */
     PAL_ZERO = 002,             /* Zero page contents. */
-    PAL_USER = 004              /* User page. */
+    PAL_USER = 004,             /* User page. */
+    PAL_NOTRACK = 010           /* Hide from the allocation tracker. */
   };
 
-void palloc_init (size_t user_page_limit);
+/* Which pools may borrow pages from the other. */
+enum palloc_lending
+  {
+    PAL_LEND_NONE,              /* Neither: pools are fixed in size. */
+    PAL_LEND_KERNEL,            /* Kernel pool borrows from user pool. */
+    PAL_LEND_USER,              /* User pool borrows from kernel pool. */
+    PAL_LEND_BOTH               /* Either pool borrows from the other. */
+  };
+
+void palloc_init (size_t user_page_limit, enum palloc_lending,
+                  unsigned reserve_pct);
 void *palloc_get_page (enum palloc_flags);
 void *palloc_get_multiple (enum palloc_flags, size_t page_cnt);
 void palloc_free_page (void *);
 void palloc_free_multiple (void *, size_t page_cnt);
+void palloc_print_stats (void);
 
 #endif /* threads/palloc.h */
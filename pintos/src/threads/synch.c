@@ -29,6 +29,7 @@
 #include "threads/synch.h"
 #include <stdio.h>
 #include <string.h>
+#include "devices/timer.h"
 #include "threads/interrupt.h"
 #include "threads/thread.h"
 
@@ -101,6 +102,71 @@ sema_try_down (struct semaphore *sema)
   return success;
 }
 
+/* A thread waiting in sema_down_timeout(). */
+struct sema_timeout
+  {
+    struct semaphore *sema;             /* Semaphore waited for. */
+    struct thread *thread;              /* Waiting thread. */
+    bool expired;                       /* Has the time run out? */
+  };
+
+/* Alarm function for sema_down_timeout().  Wakes up the waiting
+   thread described by TIMEOUT_, if it is still waiting. */
+static void
+sema_timeout_expire (void *timeout_)
+{
+  struct sema_timeout *timeout = timeout_;
+  struct list_elem *e;
+
+  timeout->expired = true;
+  for (e = list_begin (&timeout->sema->waiters);
+       e != list_end (&timeout->sema->waiters); e = list_next (e))
+    if (e == &timeout->thread->elem)
+      {
+        list_remove (e);
+        thread_unblock (timeout->thread);
+        break;
+      }
+}
+
+/* Down or "P" operation on a semaphore, but gives up if SEMA's
+   value does not become positive within approximately TICKS
+   timer ticks.  Returns true if the semaphore is decremented,
+   false if the time ran out.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+bool
+sema_down_timeout (struct semaphore *sema, int64_t ticks) 
+{
+  struct sema_timeout timeout;
+  struct timer_alarm alarm;
+  enum intr_level old_level;
+  bool success;
+
+  ASSERT (sema != NULL);
+  ASSERT (!intr_context ());
+
+  old_level = intr_disable ();
+  timeout.sema = sema;
+  timeout.thread = thread_current ();
+  timeout.expired = false;
+  timer_alarm_set (&alarm, ticks, sema_timeout_expire, &timeout);
+  while (sema->value == 0 && !timeout.expired) 
+    {
+      list_push_back (&sema->waiters, &thread_current ()->elem);
+      thread_block ();
+    }
+  timer_alarm_cancel (&alarm);
+
+  success = sema->value > 0;
+  if (success)
+    sema->value--;
+  intr_set_level (old_level);
+
+  return success;
+}
+
 /* Up or "V" operation on a semaphore.  Increments SEMA's value
    and wakes up one thread of those waiting for SEMA, if any.
 
@@ -336,3 +402,81 @@ cond_broadcast (struct condition *cond, struct lock *lock)
   while (!list_empty (&cond->waiters))
     cond_signal (cond, lock);
 }
+
+/* Initializes RWLOCK.  A readers-writer lock can be held by any
+   number of readers at once, or by a single writer.  A waiting
+   writer keeps new readers from acquiring the lock, so that a
+   steady stream of readers cannot starve writers. */
+void
+rwlock_init (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+
+  lock_init (&rwlock->lock);
+  cond_init (&rwlock->readers);
+  cond_init (&rwlock->writers);
+  rwlock->reader_cnt = 0;
+  rwlock->writer_wait_cnt = 0;
+  rwlock->writer = false;
+}
+
+/* Acquires RWLOCK for reading, sleeping until no writer holds
+   or is waiting for it. */
+void
+rwlock_acquire_read (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+
+  lock_acquire (&rwlock->lock);
+  while (rwlock->writer || rwlock->writer_wait_cnt > 0)
+    cond_wait (&rwlock->readers, &rwlock->lock);
+  rwlock->reader_cnt++;
+  lock_release (&rwlock->lock);
+}
+
+/* Releases RWLOCK, which the current thread holds for
+   reading. */
+void
+rwlock_release_read (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+
+  lock_acquire (&rwlock->lock);
+  ASSERT (rwlock->reader_cnt > 0);
+  if (--rwlock->reader_cnt == 0)
+    cond_signal (&rwlock->writers, &rwlock->lock);
+  lock_release (&rwlock->lock);
+}
+
+/* Acquires RWLOCK for writing, sleeping until no reader or
+   writer holds it. */
+void
+rwlock_acquire_write (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+
+  lock_acquire (&rwlock->lock);
+  rwlock->writer_wait_cnt++;
+  while (rwlock->writer || rwlock->reader_cnt > 0)
+    cond_wait (&rwlock->writers, &rwlock->lock);
+  rwlock->writer_wait_cnt--;
+  rwlock->writer = true;
+  lock_release (&rwlock->lock);
+}
+
+/* Releases RWLOCK, which the current thread holds for
+   writing. */
+void
+rwlock_release_write (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+
+  lock_acquire (&rwlock->lock);
+  ASSERT (rwlock->writer);
+  rwlock->writer = false;
+  if (rwlock->writer_wait_cnt > 0)
+    cond_signal (&rwlock->writers, &rwlock->lock);
+  else
+    cond_broadcast (&rwlock->readers, &rwlock->lock);
+  lock_release (&rwlock->lock);
+}
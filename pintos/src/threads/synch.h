@@ -14,6 +14,7 @@ struct semaphore
 void sema_init (struct semaphore *, unsigned value);
 void sema_down (struct semaphore *);
 bool sema_try_down (struct semaphore *);
+bool sema_down_timeout (struct semaphore *, int64_t ticks);
 void sema_up (struct semaphore *);
 void sema_self_test (void);
 
@@ -41,6 +42,23 @@ void cond_wait (struct condition *, struct lock *);
 void cond_signal (struct condition *, struct lock *);
 void cond_broadcast (struct condition *, struct lock *);
 
+/* Readers-writer lock. */
+struct rwlock
+  {
+    struct lock lock;           /* Protects the members below. */
+    struct condition readers;   /* Waiting readers. */
+    struct condition writers;   /* Waiting writers. */
+    unsigned reader_cnt;        /* Number of readers holding the lock. */
+    unsigned writer_wait_cnt;   /* Number of writers waiting. */
+    bool writer;                /* Held by a writer? */
+  };
+
+void rwlock_init (struct rwlock *);
+void rwlock_acquire_read (struct rwlock *);
+void rwlock_release_read (struct rwlock *);
+void rwlock_acquire_write (struct rwlock *);
+void rwlock_release_write (struct rwlock *);
+
 /* Optimization barrier.
 
    The compiler will not reorder operations across an
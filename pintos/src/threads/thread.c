@@ -14,6 +14,9 @@
 #ifdef USERPROG
 #include "userprog/process.h"
 #endif
+#ifdef FILESYS
+#include "filesys/directory.h"
+#endif
 
 /* Random value for struct thread's `magic' member.
    Used to detect stack overflow.  See the big comment at the top
@@ -175,14 +178,22 @@ thread_create (const char *name, int priority,
   
   ASSERT (function != NULL);
 
-  /* Allocate thread. */
-  t = palloc_get_page (PAL_ZERO);
+  /* Allocate thread.  The page is hidden from the allocation
+     tracker because thread_schedule_tail() frees it in the middle
+     of a context switch, where the tracker's lock may not be
+     acquired. */
+  t = palloc_get_page (PAL_ZERO | PAL_NOTRACK);
   if (t == NULL)
     return TID_ERROR;
 
   /* Initialize thread. */
   init_thread (t, name, priority);
   tid = t->tid = allocate_tid ();
+#ifdef FILESYS
+  /* Start out in the creator's working directory. */
+  if (thread_current ()->cwd != NULL)
+    t->cwd = dir_reopen (thread_current ()->cwd);
+#endif
 
   /* Prepare thread for first run by initializing its stack.
      Do this atomically so intermediate values for the 'stack' 
@@ -293,6 +304,10 @@ thread_exit (void)
 #ifdef USERPROG
   process_exit ();
 #endif
+#ifdef FILESYS
+  dir_close (thread_current ()->cwd);
+#endif
+  arena_destroy (&thread_current ()->arena);
 
   /* Remove thread from all threads list, set our status to dying,
      and schedule another process.  That process will destroy us
@@ -472,6 +487,7 @@ init_thread (struct thread *t, const char *name, int priority)
   
   //Initiallize semaphore (Kevin)
   sema_init(&t->s,0);
+  arena_init (&t->arena);
 
   list_push_back (&all_list, &t->allelem);
 }
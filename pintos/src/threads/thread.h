@@ -4,6 +4,7 @@
 #include <debug.h>
 #include <list.h>
 #include <stdint.h>
+#include "threads/arena.h"
 #include <threads/synch.h>
 
 /* States in a thread's life cycle. */
@@ -98,6 +99,15 @@ struct thread
     // Added timer list (Jim)
     struct list_elem timer_list_elem;
 
+    /* Owned by threads/arena.c. */
+    struct arena arena;                 /* Scratch memory, see arena.h. */
+
+#ifdef FILESYS
+    /* Owned by filesys/filesys.c. */
+    struct dir *cwd;                    /* Working directory, or null
+                                           for the root directory. */
+#endif
+
 #ifdef USERPROG
     /* Owned by userprog/process.c. */
     uint32_t *pagedir;                  /* Page directory. */
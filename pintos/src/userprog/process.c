@@ -209,7 +209,10 @@ bool
 load (const char *file_name, void (**eip) (void), void **esp) 
 {
   struct thread *t = thread_current ();
+  void *scratch_top = arena_top (&t->arena);
   struct Elf32_Ehdr ehdr;
+  struct Elf32_Phdr *phdrs;
+  int phdr_max = ARENA_MAX / sizeof *phdrs;
   struct file *file = NULL;
   off_t file_ofs;
   bool success = false;
@@ -242,20 +245,29 @@ load (const char *file_name, void (**eip) (void), void **esp)
       goto done; 
     }
 
-  /* Read program headers. */
+  /* Read program headers, as many at a time as fit in a scratch
+     buffer.  load_segment() moves the file position, so read
+     them at explicit offsets. */
+  phdrs = arena_alloc (&t->arena, phdr_max * sizeof *phdrs);
+  if (phdrs == NULL)
+    goto done;
   file_ofs = ehdr.e_phoff;
   for (i = 0; i < ehdr.e_phnum; i++) 
     {
-      struct Elf32_Phdr phdr;
+      struct Elf32_Phdr *phdr = &phdrs[i % phdr_max];
 
-      if (file_ofs < 0 || file_ofs > file_length (file))
-        goto done;
-      file_seek (file, file_ofs);
+      if (i % phdr_max == 0)
+        {
+          int cnt = ehdr.e_phnum - i < phdr_max ? ehdr.e_phnum - i : phdr_max;
+          off_t size = cnt * sizeof *phdrs;
 
-      if (file_read (file, &phdr, sizeof phdr) != sizeof phdr)
-        goto done;
-      file_ofs += sizeof phdr;
-      switch (phdr.p_type) 
+          if (file_ofs < 0 || file_ofs > file_length (file))
+            goto done;
+          if (file_read_at (file, phdrs, size, file_ofs) != size)
+            goto done;
+          file_ofs += size;
+        }
+      switch (phdr->p_type) 
         {
         case PT_NULL:
         case PT_NOTE:
@@ -269,19 +281,19 @@ load (const char *file_name, void (**eip) (void), void **esp)
         case PT_SHLIB:
           goto done;
         case PT_LOAD:
-          if (validate_segment (&phdr, file)) 
+          if (validate_segment (phdr, file)) 
             {
-              bool writable = (phdr.p_flags & PF_W) != 0;
-              uint32_t file_page = phdr.p_offset & ~PGMASK;
-              uint32_t mem_page = phdr.p_vaddr & ~PGMASK;
-              uint32_t page_offset = phdr.p_vaddr & PGMASK;
+              bool writable = (phdr->p_flags & PF_W) != 0;
+              uint32_t file_page = phdr->p_offset & ~PGMASK;
+              uint32_t mem_page = phdr->p_vaddr & ~PGMASK;
+              uint32_t page_offset = phdr->p_vaddr & PGMASK;
               uint32_t read_bytes, zero_bytes;
-              if (phdr.p_filesz > 0)
+              if (phdr->p_filesz > 0)
                 {
                   /* Normal segment.
                      Read initial part from disk and zero the rest. */
-                  read_bytes = page_offset + phdr.p_filesz;
-                  zero_bytes = (ROUND_UP (page_offset + phdr.p_memsz, PGSIZE)
+                  read_bytes = page_offset + phdr->p_filesz;
+                  zero_bytes = (ROUND_UP (page_offset + phdr->p_memsz, PGSIZE)
                                 - read_bytes);
                 }
               else 
@@ -289,7 +301,7 @@ load (const char *file_name, void (**eip) (void), void **esp)
                   /* Entirely zero.
                      Don't read anything from disk. */
                   read_bytes = 0;
-                  zero_bytes = ROUND_UP (page_offset + phdr.p_memsz, PGSIZE);
+                  zero_bytes = ROUND_UP (page_offset + phdr->p_memsz, PGSIZE);
                 }
               if (!load_segment (file, file_page, (void *) mem_page,
                                  read_bytes, zero_bytes, writable))
@@ -311,8 +323,10 @@ load (const char *file_name, void (**eip) (void), void **esp)
   success = true;
 
  done:
-  /* We arrive here whether the load is successful or not. */
+  /* We arrive here whether the load is successful or not.
+     Release any scratch memory used while loading. */
   file_close (file);
+  arena_reset (&t->arena, scratch_top);
   return success;
 }
 